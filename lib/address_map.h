@@ -0,0 +1,140 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "sharded_counter.h"
+#include "tracer_memory.h"
+
+struct BlockInfo {
+    std::uintptr_t site; // see allocation_site()
+    std::size_t    alloc_size;
+#ifdef TURN_ON_LIFETIMES
+    std::uint64_t alloc_tsc = 0; // read_tsc() when the block was allocated
+#endif
+};
+
+// Lock-free hash map from block address to BlockInfo in tracer-owned memory.
+// An address hashes to two buckets of 7 slots (one cache line of keys each). A slot is claimed with a CAS
+// and released with a plain store, so there are no tombstones and the map never degrades with churn.
+// The second bucket is read only if the first one has ever been full, so a miss usually costs one line.
+// Every address is inserted and removed by its owner only, which is what makes the protocol safe.
+struct AddressMap {
+    static constexpr std::size_t    SLOTS = 7;
+    static constexpr std::uintptr_t BUSY = 1; // claimed slot whose value is being written
+
+    struct alignas(CACHE_LINE_SIZE) Bucket {
+        std::atomic_uintptr_t keys[SLOTS];
+        std::atomic_uintptr_t spilled; // an insert went to the second bucket
+    };
+
+    Bucket*              buckets = nullptr;
+    BlockInfo*           values = nullptr;
+    std::size_t          bucket_count = 0;
+    unsigned             shift = 64;
+    std::atomic_uint64_t dropped{0}; // inserts that found both buckets full
+
+    bool init(std::size_t bucketCount) {
+        buckets = static_cast<Bucket*>(map_tracer_memory(bucketCount * sizeof(Bucket)));
+        values = static_cast<BlockInfo*>(map_tracer_memory(bucketCount * SLOTS * sizeof(BlockInfo)));
+        if (!buckets || !values) {
+            return false;
+        }
+        bucket_count = bucketCount;
+        shift = 64 - __builtin_ctzll(bucketCount);
+        return true;
+    }
+
+    bool insert(std::uintptr_t addr, const BlockInfo& info) {
+        std::size_t first = bucket_of(addr, 0x9E3779B97F4A7C15ull);
+        if (claim(first, addr, info)) {
+            return true;
+        }
+        buckets[first].spilled.store(1, std::memory_order_relaxed);
+        if (claim(bucket_of(addr, 0xC2B2AE3D27D4EB4Full), addr, info)) {
+            return true;
+        }
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    bool find(std::uintptr_t addr, BlockInfo* info) const {
+        const std::atomic_uintptr_t* key = find_key(addr);
+        if (!key) {
+            return false;
+        }
+        *info = values[key_index(key)];
+        return true;
+    }
+
+    bool remove(std::uintptr_t addr, BlockInfo* info) {
+        std::atomic_uintptr_t* key = const_cast<std::atomic_uintptr_t*>(find_key(addr));
+        if (!key) {
+            return false;
+        }
+        *info = values[key_index(key)];
+        key->store(0, std::memory_order_release);
+        return true;
+    }
+
+    // Calls visit(addr, info) for every entry. Entries inserted meanwhile, also by visit, may be skipped or
+    // visited. Reads the whole map.
+    template <typename Visit>
+    void for_each(Visit visit) const {
+        for (std::size_t idx = 0; idx < bucket_count; ++idx) {
+            for (auto& key : buckets[idx].keys) {
+                std::uintptr_t addr = key.load(std::memory_order_acquire);
+                if (addr > BUSY) {
+                    visit(addr, values[key_index(&key)]);
+                }
+            }
+        }
+    }
+
+private:
+    std::size_t bucket_of(std::uintptr_t addr, std::uint64_t mul) const {
+        return ((addr >> 4) * mul) >> shift;
+    }
+
+    std::size_t key_index(const std::atomic_uintptr_t* key) const {
+        std::size_t offset = reinterpret_cast<const char*>(key) - reinterpret_cast<const char*>(buckets);
+        return offset / sizeof(Bucket) * SLOTS + offset % sizeof(Bucket) / sizeof(*key);
+    }
+
+    bool claim(std::size_t idx, std::uintptr_t addr, const BlockInfo& info) {
+        for (auto& key : buckets[idx].keys) {
+            std::uintptr_t expected = 0;
+            if (key.load(std::memory_order_relaxed) == 0 &&
+                key.compare_exchange_strong(expected, BUSY, std::memory_order_acquire)) {
+                values[key_index(&key)] = info;
+                key.store(addr, std::memory_order_release);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const std::atomic_uintptr_t* find_in(std::size_t idx, std::uintptr_t addr) const {
+        for (const auto& key : buckets[idx].keys) {
+            if (key.load(std::memory_order_acquire) == addr) {
+                return &key;
+            }
+        }
+        return nullptr;
+    }
+
+    const std::atomic_uintptr_t* find_key(std::uintptr_t addr) const {
+        if (!buckets) {
+            return nullptr;
+        }
+        std::size_t first = bucket_of(addr, 0x9E3779B97F4A7C15ull);
+        if (const std::atomic_uintptr_t* key = find_in(first, addr)) {
+            return key;
+        }
+        if (buckets[first].spilled.load(std::memory_order_relaxed) == 0) {
+            return nullptr;
+        }
+        return find_in(bucket_of(addr, 0xC2B2AE3D27D4EB4Full), addr);
+    }
+};
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <cstddef>
+
+#include <malloc.h>
+
+// The allocator under the tracer, chosen with -DMALLOC_TRACER_BACKEND=glibc|jemalloc|tcmalloc|mimalloc. The
+// hooks call it through mem_func_orig and ask Backend for block sizes and, when HAS_SIZED_FREE, to free
+// blocks of a known size. Backends other than glibc are resolved with dlsym(RTLD_NEXT), so they are loaded
+// after the tracer: LD_PRELOAD="libmalloc_tracer.so libjemalloc.so", or as a dependency of the application.
+
+#ifdef LINK_TIME_WRAP
+extern "C" std::size_t __real_malloc_usable_size(void* ptr);
+#endif
+
+template <typename Func>
+Func resolve_backend_function(const char* backend, const char* name) {
+    auto func = reinterpret_cast<Func>(dlsym(RTLD_NEXT, name));
+    if (!func) {
+        fprintf(stderr, "Error: no %s() of the %s backend, is it loaded?\n", name, backend);
+        exit(1);
+    }
+    return func;
+}
+
+struct GlibcBackend {
+    static constexpr const char* NAME = "glibc";
+    static constexpr bool        HAS_LIBC_SYMBOLS = true; // see bind_libc_functions() in main.cpp
+    static constexpr bool        HAS_SIZED_FREE = false;
+
+    // glibc's malloc_usable_size() of a live block: the chunk size word before the block, less the chunk
+    // header, and less the unused prev_size word of the next chunk for an mmap()ed chunk.
+    static std::size_t chunk_usable_size(void* ptr) {
+        std::size_t chunkSize = static_cast<std::size_t*>(ptr)[-1];
+        return (chunkSize & ~std::size_t{7}) - (chunkSize & 2 ? 2 : 1) * sizeof(std::size_t);
+    }
+
+    // glibc's, the tracer interposes malloc_usable_size() itself. Reads the chunk header until init(), as
+    // when glibc's allocator is bound without dlsym().
+    static inline std::size_t (*malloc_usable_size)(void* ptr) = chunk_usable_size;
+
+    static void init([[maybe_unused]] bool resolvedByName) {
+#ifdef LINK_TIME_WRAP
+        malloc_usable_size = __real_malloc_usable_size;
+#else
+        if (resolvedByName) { // dlsym() found the allocator already, it may be another one preloaded later
+            malloc_usable_size =
+                resolve_backend_function<decltype(malloc_usable_size)>(NAME, "malloc_usable_size");
+        }
+#endif
+        // M_CHECK_ACTION: If bit 0 is set, then print a one-line message on stderr
+        // that provides details about the error. Program won't be terminated by
+        // calling abort and program will continue execution
+        mallopt(M_CHECK_ACTION, 1);
+    }
+    static std::size_t usable_size(void* ptr) { return malloc_usable_size(ptr); }
+    static void        sized_free(void*, std::size_t) {} // not called
+};
+
+// Unprefixed jemalloc, as the distributions build it.
+struct JemallocBackend {
+    static constexpr const char* NAME = "jemalloc";
+    static constexpr bool        HAS_LIBC_SYMBOLS = false;
+    static constexpr bool        HAS_SIZED_FREE = true;
+
+    static inline std::size_t (*sallocx)(const void* ptr, int flags) = nullptr;
+    static inline void (*sdallocx)(void* ptr, std::size_t size, int flags) = nullptr;
+
+    static void init(bool) {
+        sallocx = resolve_backend_function<decltype(sallocx)>(NAME, "sallocx");
+        sdallocx = resolve_backend_function<decltype(sdallocx)>(NAME, "sdallocx");
+    }
+    static std::size_t usable_size(void* ptr) { return sallocx(ptr, 0); }
+    static void        sized_free(void* ptr, std::size_t size) { sdallocx(ptr, size, 0); }
+};
+
+struct TcmallocBackend {
+    static constexpr const char* NAME = "tcmalloc";
+    static constexpr bool        HAS_LIBC_SYMBOLS = false;
+    static constexpr bool        HAS_SIZED_FREE = true;
+
+    static inline std::size_t (*tc_malloc_size)(void* ptr) = nullptr;
+    static inline void (*tc_free_sized)(void* ptr, std::size_t size) = nullptr;
+
+    static void init(bool) {
+        tc_malloc_size = resolve_backend_function<decltype(tc_malloc_size)>(NAME, "tc_malloc_size");
+        tc_free_sized = resolve_backend_function<decltype(tc_free_sized)>(NAME, "tc_free_sized");
+    }
+    static std::size_t usable_size(void* ptr) { return tc_malloc_size(ptr); }
+    static void        sized_free(void* ptr, std::size_t size) { tc_free_sized(ptr, size); }
+};
+
+struct MimallocBackend {
+    static constexpr const char* NAME = "mimalloc";
+    static constexpr bool        HAS_LIBC_SYMBOLS = false;
+    static constexpr bool        HAS_SIZED_FREE = true;
+
+    static inline std::size_t (*mi_usable_size)(const void* ptr) = nullptr;
+    static inline void (*mi_free_size)(void* ptr, std::size_t size) = nullptr;
+
+    static void init(bool) {
+        mi_usable_size = resolve_backend_function<decltype(mi_usable_size)>(NAME, "mi_usable_size");
+        mi_free_size = resolve_backend_function<decltype(mi_free_size)>(NAME, "mi_free_size");
+    }
+    static std::size_t usable_size(void* ptr) { return mi_usable_size(ptr); }
+    static void        sized_free(void* ptr, std::size_t size) { mi_free_size(ptr, size); }
+};
+
+#if defined(BACKEND_JEMALLOC)
+using Backend = JemallocBackend;
+#elif defined(BACKEND_TCMALLOC)
+using Backend = TcmallocBackend;
+#elif defined(BACKEND_MIMALLOC)
+using Backend = MimallocBackend;
+#else
+using Backend = GlibcBackend;
+#endif
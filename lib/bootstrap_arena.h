@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "tracer_memory.h"
+
+// Allocator for the calls made before the real allocator is resolved: dlsym() allocates, and so may threads
+// started by static initializers meanwhile. Blocks are bumped lock-free from a region reserved on first use.
+// The kernel commits its pages on first touch, so the arena grows with use up to the reservation. Blocks are
+// never reused and start zeroed: free() ignores them and realloc() moves them to the real allocator.
+struct BootstrapArena {
+    static constexpr std::size_t SIZE = 1 << 26;
+    static constexpr std::size_t HEADER = 16; // the size of the block is kept right before its data
+
+    std::atomic<char*> base{nullptr};
+    std::atomic_size_t used{0};
+
+    // Returns NULL when the arena is exhausted. alignment must be a power of two.
+    void* allocate(std::size_t size, std::size_t alignment = HEADER) {
+        char* region = base.load(std::memory_order_acquire);
+        if (!region) {
+            auto* mapped = static_cast<char*>(map_tracer_memory(SIZE));
+            if (!mapped) {
+                return nullptr;
+            }
+            if (base.compare_exchange_strong(region, mapped, std::memory_order_acq_rel)) {
+                region = mapped;
+            } else {
+                tracer_munmap(mapped, SIZE); // another thread reserved it first
+            }
+        }
+        alignment = alignment < HEADER ? HEADER : alignment;
+        if (size > SIZE || alignment > SIZE) {
+            return nullptr;
+        }
+        std::size_t need = (size + HEADER + alignment - 1 + HEADER - 1) & ~(HEADER - 1);
+        std::size_t offset = used.fetch_add(need, std::memory_order_relaxed);
+        if (offset + need > SIZE) {
+            return nullptr;
+        }
+        auto start = reinterpret_cast<std::uintptr_t>(region + offset) + HEADER;
+        auto data = (start + alignment - 1) & ~(alignment - 1);
+        reinterpret_cast<std::size_t*>(data)[-1] = size;
+        return reinterpret_cast<void*>(data);
+    }
+
+    bool contains(const void* ptr) const {
+        const char* region = base.load(std::memory_order_relaxed);
+        return region && ptr >= region && ptr < region + SIZE;
+    }
+
+    std::size_t size_of(const void* ptr) const {
+        return static_cast<const std::size_t*>(ptr)[-1];
+    }
+};
@@ -0,0 +1,73 @@
+#include "callsite_table.h"
+
+#include <new>
+
+#include "malloc_tracer.h"
+#ifdef TURN_ON_STACK_IDS
+#    include "stack_table.h"
+#endif
+#include "tracer_memory.h"
+
+CallsiteTable CALLSITE_TABLE;
+
+#ifdef CALLSITE_HISTOGRAMS
+// Every slot and the overflow record, with room for the histograms lost in attach races.
+constexpr std::size_t HISTOGRAMS_CAPACITY = 2 * (CALLSITE_TABLE_SIZE + 1);
+
+static std::atomic<CallsiteHistograms*> HISTOGRAMS{nullptr};
+static std::atomic_size_t               HISTOGRAMS_USED{0};
+
+CallsiteHistograms* allocate_callsite_histograms() {
+    constexpr std::size_t size = HISTOGRAMS_CAPACITY * sizeof(CallsiteHistograms);
+    CallsiteHistograms*   region = HISTOGRAMS.load(std::memory_order_acquire);
+    if (!region) {
+        auto* mapped = static_cast<CallsiteHistograms*>(map_tracer_memory(size));
+        if (!mapped) {
+            return nullptr;
+        }
+        if (HISTOGRAMS.compare_exchange_strong(region, mapped, std::memory_order_acq_rel)) {
+            region = mapped;
+        } else {
+            tracer_munmap(mapped, size); // another thread reserved it first
+        }
+    }
+    std::size_t index = HISTOGRAMS_USED.fetch_add(1, std::memory_order_relaxed);
+    return index < HISTOGRAMS_CAPACITY ? new (region + index) CallsiteHistograms : nullptr;
+}
+#endif
+
+static void copy_callsite(const CallsiteStats& stats, std::uintptr_t site, malloc_tracer_callsite* out) {
+#ifdef TURN_ON_STACK_IDS
+    out->ret_addr = site ? STACK_TABLE.site(static_cast<std::uint32_t>(site)) : 0;
+    out->stack_id = static_cast<std::uint32_t>(site);
+#else
+    out->ret_addr = site;
+    out->stack_id = 0;
+#endif
+    out->live_count = stats.live_count.load(std::memory_order_relaxed);
+    out->live_bytes = stats.live_bytes.load(std::memory_order_relaxed);
+    out->total_count = stats.total_count.load(std::memory_order_relaxed);
+    out->total_bytes = stats.total_bytes.load(std::memory_order_relaxed);
+}
+
+extern "C" size_t malloc_tracer_callsites(malloc_tracer_callsite* out, size_t max_count) {
+    size_t count = 0;
+    for (const auto& stats : CALLSITE_TABLE.sites) {
+        std::uintptr_t site = stats.site.load(std::memory_order_acquire);
+        if (site == 0) {
+            continue;
+        }
+        if (count < max_count) {
+            copy_callsite(stats, site, out + count);
+        }
+        ++count;
+    }
+    // allocations with an unknown or unplaced site are reported with ret_addr = 0
+    if (CALLSITE_TABLE.overflow.total_count.load(std::memory_order_relaxed) != 0) {
+        if (count < max_count) {
+            copy_callsite(CALLSITE_TABLE.overflow, 0, out + count);
+        }
+        ++count;
+    }
+    return count;
+}
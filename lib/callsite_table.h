@@ -0,0 +1,216 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "malloc_tracer.h"
+#include "sharded_counter.h"
+
+constexpr std::size_t CALLSITE_TABLE_SIZE = 1 << 16; // must be a power of two
+constexpr std::size_t CALLSITE_MAX_PROBES = 128;
+
+#if defined(TURN_ON_SIZE_HISTOGRAMS) || defined(TURN_ON_LIFETIMES)
+#    define CALLSITE_HISTOGRAMS
+#endif
+
+#ifdef CALLSITE_HISTOGRAMS
+// Histograms of a site. They take over a kilobyte, so only the sites with samples get them, bumped from a
+// region that is reserved on first use and committed by the kernel page by page.
+struct CallsiteHistograms {
+#    ifdef TURN_ON_SIZE_HISTOGRAMS
+    // allocations by request size, see malloc_tracer_size_bucket()
+    std::atomic_int64_t sizes[MALLOC_TRACER_SIZE_BUCKETS]{};
+#    endif
+#    ifdef TURN_ON_LIFETIMES
+    // frees by log2 of the block lifetime in read_tsc() ticks, see malloc_tracer_lifetimes()
+    std::atomic_int64_t lifetimes[MALLOC_TRACER_LIFETIME_BUCKETS]{};
+#    endif
+};
+
+// Zeroed histograms for a site. Returns NULL when the region is exhausted or cannot be mapped.
+CallsiteHistograms* allocate_callsite_histograms();
+#endif
+
+struct alignas(CACHE_LINE_SIZE) CallsiteStats {
+    std::atomic_uintptr_t site{0}; // 0 - free slot
+    std::atomic_int64_t   live_count{0};
+    std::atomic_int64_t   live_bytes{0};
+    std::atomic_int64_t   total_count{0};
+    std::atomic_int64_t   total_bytes{0};
+
+    // count and bytes are more than 1 and the allocation size for sampled allocations
+    void on_alloc(std::int64_t count, std::int64_t bytes) {
+        live_count.fetch_add(count, std::memory_order_relaxed);
+        live_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        total_count.fetch_add(count, std::memory_order_relaxed);
+        total_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    void on_free(std::int64_t count, std::int64_t bytes) {
+        live_count.fetch_sub(count, std::memory_order_relaxed);
+        live_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+
+#ifdef CALLSITE_HISTOGRAMS
+    std::atomic<CallsiteHistograms*> histograms{nullptr}; // attached on the first sample of the site
+
+    // Returns NULL when no memory is left for the histograms.
+    CallsiteHistograms* get_histograms() {
+        CallsiteHistograms* current = histograms.load(std::memory_order_acquire);
+        if (!current) {
+            CallsiteHistograms* fresh = allocate_callsite_histograms();
+            if (fresh && histograms.compare_exchange_strong(current, fresh, std::memory_order_acq_rel)) {
+                current = fresh;
+            } // otherwise another thread attached its histograms first and fresh stays unused
+        }
+        return current;
+    }
+#endif
+
+#ifdef TURN_ON_SIZE_HISTOGRAMS
+    void on_size(std::size_t size, std::int64_t count) {
+        if (CallsiteHistograms* h = get_histograms()) {
+            h->sizes[malloc_tracer_size_bucket(size)].fetch_add(count, std::memory_order_relaxed);
+        }
+    }
+#endif
+
+#ifdef TURN_ON_REALLOC_STATS
+    // reallocs that kept or moved the block, and the bytes copied by the moves, see malloc_tracer_reallocs()
+    std::atomic_int64_t reallocs_in_place{0};
+    std::atomic_int64_t reallocs_moved{0};
+    std::atomic_int64_t realloc_copied_bytes{0};
+
+    void on_realloc(bool moved, std::int64_t copiedBytes, std::int64_t count) {
+        if (moved) {
+            reallocs_moved.fetch_add(count, std::memory_order_relaxed);
+            realloc_copied_bytes.fetch_add(copiedBytes * count, std::memory_order_relaxed);
+        } else {
+            reallocs_in_place.fetch_add(count, std::memory_order_relaxed);
+        }
+    }
+#endif
+
+#ifdef TURN_ON_MMAP_STATS
+    // live regions mapped by mmap(), mremap() and sbrk() called from the site, their bytes and all bytes the
+    // site ever mapped, see malloc_tracer_mappings()
+    std::atomic_int64_t mapped_regions{0};
+    std::atomic_int64_t mapped_bytes{0};
+    std::atomic_int64_t total_mapped_bytes{0};
+
+    // regions and bytes are negative for unmapped ones
+    void on_map(std::int64_t regions, std::int64_t bytes) {
+        mapped_regions.fetch_add(regions, std::memory_order_relaxed);
+        mapped_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        if (bytes > 0) {
+            total_mapped_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        }
+    }
+#endif
+
+#ifdef TURN_ON_ALLOC_LATENCY
+    // allocator calls slower than MALLOC_TRACER_SLOW_ALLOC_NS
+    std::atomic_int64_t  slow_calls{0};
+    std::atomic_uint64_t max_call_ticks{0};
+
+    void on_slow_call(std::uint64_t ticks) {
+        slow_calls.fetch_add(1, std::memory_order_relaxed);
+        std::uint64_t max = max_call_ticks.load(std::memory_order_relaxed);
+        while (ticks > max && !max_call_ticks.compare_exchange_weak(max, ticks, std::memory_order_relaxed)) {
+        }
+    }
+#endif
+
+#ifdef TURN_ON_LIFETIMES
+    void on_lifetime(std::uint64_t ticks, std::int64_t count) {
+        unsigned bucket = 63 - __builtin_clzll(ticks | 1);
+        bucket = bucket < MALLOC_TRACER_LIFETIME_BUCKETS ? bucket : MALLOC_TRACER_LIFETIME_BUCKETS - 1;
+        if (CallsiteHistograms* h = get_histograms()) {
+            h->lifetimes[bucket].fetch_add(count, std::memory_order_relaxed);
+        }
+    }
+#endif
+};
+
+// Lock-free open-addressing table of allocation statistics keyed by allocation site: the return
+// address or the STACK_TABLE id with TURN_ON_STACK_IDS.
+// Slots are claimed with a CAS on the site and never released, so a found slot stays valid forever.
+// Sites that do not fit in CALLSITE_MAX_PROBES slots are accumulated in `overflow`.
+struct CallsiteTable {
+    CallsiteStats        sites[CALLSITE_TABLE_SIZE];
+    CallsiteStats        overflow;
+    std::atomic_uint64_t unknown_frees{0};
+
+    static std::size_t slot_of(std::uintptr_t site) {
+        return (site * 0x9E3779B97F4A7C15ull) >> (64 - __builtin_ctzll(CALLSITE_TABLE_SIZE));
+    }
+
+    // Finds the slot of site or claims a free one.
+    CallsiteStats* get(std::uintptr_t site) {
+        if (site == 0) {
+            return &overflow;
+        }
+        std::size_t idx = slot_of(site);
+        for (std::size_t probe = 0; probe < CALLSITE_MAX_PROBES; ++probe) {
+            CallsiteStats& slot = sites[(idx + probe) & (CALLSITE_TABLE_SIZE - 1)];
+            std::uintptr_t key = slot.site.load(std::memory_order_relaxed);
+            if (key == site) {
+                return &slot;
+            }
+            if (key == 0 && (slot.site.compare_exchange_strong(key, site, std::memory_order_relaxed) ||
+                             key == site)) {
+                return &slot;
+            }
+        }
+        return &overflow;
+    }
+
+    // Finds the slot of site without claiming a new one. Returns NULL for a never seen site.
+    CallsiteStats* find(std::uintptr_t site) {
+        if (site == 0) {
+            return &overflow;
+        }
+        std::size_t idx = slot_of(site);
+        for (std::size_t probe = 0; probe < CALLSITE_MAX_PROBES; ++probe) {
+            CallsiteStats& slot = sites[(idx + probe) & (CALLSITE_TABLE_SIZE - 1)];
+            std::uintptr_t key = slot.site.load(std::memory_order_relaxed);
+            if (key == site) {
+                return &slot;
+            }
+            if (key == 0) {
+                return nullptr;
+            }
+        }
+        return &overflow; // the whole probe window is taken, get() put site there
+    }
+
+    // Returns the slot of site.
+    CallsiteStats* on_alloc(std::uintptr_t site, std::int64_t count, std::int64_t bytes) {
+        CallsiteStats* stats = get(site);
+        stats->on_alloc(count, bytes);
+        return stats;
+    }
+
+    // Returns the slot of site, NULL for a never seen site.
+    CallsiteStats* on_free(std::uintptr_t site, std::int64_t count, std::int64_t bytes) {
+        CallsiteStats* stats = find(site);
+        if (stats) {
+            stats->on_free(count, bytes);
+        } else {
+            unknown_frees.fetch_add(1, std::memory_order_relaxed);
+        }
+        return stats;
+    }
+};
+
+extern CallsiteTable CALLSITE_TABLE;
+
+// Site of a record returned by malloc_tracer_callsites().
+inline std::uintptr_t callsite_key(const malloc_tracer_callsite& site) {
+#ifdef TURN_ON_STACK_IDS
+    return site.stack_id;
+#else
+    return site.ret_addr;
+#endif
+}
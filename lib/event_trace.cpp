@@ -0,0 +1,257 @@
+#include "event_trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <new>
+
+#include "tracer_memory.h"
+#include "tracer_thread.h"
+
+extern std::uint32_t MALLOC_TRACER_FOOTER_FORMAT;
+
+constexpr std::size_t   MAX_EVENT_RINGS = 1024;
+constexpr std::size_t   DEFAULT_RING_EVENTS = 1 << 16;
+constexpr std::size_t   TRACE_WINDOW_SIZE = 16 << 20; // mapped part of the trace file, a multiple of the page
+constexpr long          DRAIN_INTERVAL_NS = 1000 * 1000;
+constexpr std::uint32_t RING_FREE = 0;
+constexpr std::uint32_t RING_OWNED = 1;
+constexpr std::uint32_t RING_EXITED = 2; // the owner thread exited, free once drained
+
+// Single-producer single-consumer ring: the owner thread moves head, the drain thread moves tail.
+// A ring outlives its thread and is reused by a new thread once drained.
+struct EventRing {
+    alignas(CACHE_LINE_SIZE) std::atomic_uint64_t head{0};
+    std::atomic_uint64_t dropped{0};
+    alignas(CACHE_LINE_SIZE) std::atomic_uint64_t tail{0};
+    std::atomic_uint32_t state{RING_OWNED};
+    std::uint32_t        thread = 0;
+    TraceEvent*          events = nullptr;
+};
+
+static bool                     TRACE_ENABLED = false;
+static std::size_t              RING_EVENTS = DEFAULT_RING_EVENTS;
+static std::atomic<EventRing*>  RINGS[MAX_EVENT_RINGS];
+static std::atomic_size_t       RING_COUNT{0};
+static std::atomic_uint64_t     NO_RING_DROPPED{0};
+static pthread_key_t            RING_KEY;
+static pthread_t                DRAIN_THREAD;
+static std::atomic_bool         DRAIN_STOP{false};
+static thread_local EventRing*  THREAD_RING TRACER_TLS = nullptr;
+static thread_local bool        THREAD_NO_RING TRACER_TLS = false;
+
+static struct TraceFile {
+    int             fd = -1;
+    char*           window = nullptr;
+    std::uint64_t   window_offset = 0;
+    std::uint64_t   size = sizeof(TraceFileHeader);
+    TraceFileHeader header{};
+} trace_file;
+
+// Runs in the exiting thread. Its later events, e.g. from other key destructors, are counted in
+// NO_RING_DROPPED instead of going to a ring that may already belong to another thread.
+static void release_ring(void* ring) {
+    THREAD_RING = nullptr;
+    THREAD_NO_RING = true;
+    static_cast<EventRing*>(ring)->state.store(RING_EXITED, std::memory_order_release);
+}
+
+__attribute__((noinline)) static EventRing* acquire_ring() {
+    EventRing* ring = nullptr;
+    for (std::size_t i = 0; i < RING_COUNT.load(std::memory_order_acquire) && !ring; ++i) {
+        EventRing*    candidate = RINGS[i].load(std::memory_order_acquire);
+        std::uint32_t state = RING_FREE;
+        if (candidate &&
+            candidate->state.compare_exchange_strong(state, RING_OWNED, std::memory_order_acquire)) {
+            ring = candidate;
+        }
+    }
+    if (!ring) {
+        std::size_t idx = RING_COUNT.fetch_add(1, std::memory_order_acq_rel);
+        void*       memory = idx < MAX_EVENT_RINGS
+                                 ? map_tracer_memory(sizeof(EventRing) + RING_EVENTS * sizeof(TraceEvent))
+                                 : nullptr;
+        if (!memory) {
+            THREAD_NO_RING = true;
+            return nullptr;
+        }
+        ring = new (memory) EventRing;
+        ring->events = reinterpret_cast<TraceEvent*>(ring + 1);
+        RINGS[idx].store(ring, std::memory_order_release);
+    }
+    ring->thread = static_cast<std::uint32_t>(syscall(SYS_gettid));
+    // first: pthread_setspecific() may calloc() the key block, whose event goes to this ring then
+    THREAD_RING = ring;
+    pthread_setspecific(RING_KEY, ring);
+    return ring;
+}
+
+void trace_event(TraceOp op, void* ptr, void* old_ptr, std::size_t size, std::uintptr_t site) {
+    if (!TRACE_ENABLED) {
+        return;
+    }
+    EventRing* ring = THREAD_RING;
+    if (__builtin_expect(!ring, 0) && (THREAD_NO_RING || !(ring = acquire_ring()))) {
+        NO_RING_DROPPED.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    std::uint64_t head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) >= RING_EVENTS) {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    ring->events[head & (RING_EVENTS - 1)] = {read_tsc(),
+                                              reinterpret_cast<std::uint64_t>(ptr),
+                                              reinterpret_cast<std::uint64_t>(old_ptr),
+                                              size,
+                                              site,
+                                              ring->thread,
+                                              op};
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+// Maps the window of the trace file that contains `size`, growing the file.
+static bool map_trace_window() {
+    std::uint64_t offset = trace_file.size / TRACE_WINDOW_SIZE * TRACE_WINDOW_SIZE;
+    if (trace_file.window) {
+        tracer_munmap(trace_file.window, TRACE_WINDOW_SIZE);
+        trace_file.window = nullptr;
+    }
+    if (ftruncate(trace_file.fd, offset + TRACE_WINDOW_SIZE) != 0) {
+        return false;
+    }
+    void* window =
+        tracer_mmap(NULL, TRACE_WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, trace_file.fd, offset);
+    if (window == MAP_FAILED) {
+        return false;
+    }
+    trace_file.window = static_cast<char*>(window);
+    trace_file.window_offset = offset;
+    return true;
+}
+
+static void append_events(const TraceEvent* events, std::size_t count) {
+    const char* data = reinterpret_cast<const char*>(events);
+    std::size_t bytes = count * sizeof(TraceEvent);
+    while (bytes > 0) {
+        if (!trace_file.window || trace_file.size >= trace_file.window_offset + TRACE_WINDOW_SIZE) {
+            if (!map_trace_window()) {
+                trace_file.header.dropped += bytes / sizeof(TraceEvent);
+                return;
+            }
+        }
+        std::size_t chunk = trace_file.window_offset + TRACE_WINDOW_SIZE - trace_file.size;
+        chunk = chunk < bytes ? chunk : bytes;
+        memcpy(trace_file.window + (trace_file.size - trace_file.window_offset), data, chunk);
+        trace_file.size += chunk;
+        data += chunk;
+        bytes -= chunk;
+    }
+    trace_file.header.events += count;
+}
+
+static void drain_rings() {
+    std::uint64_t dropped = NO_RING_DROPPED.load(std::memory_order_relaxed);
+    std::size_t   ringCount = RING_COUNT.load(std::memory_order_acquire);
+    for (std::size_t i = 0; i < ringCount && i < MAX_EVENT_RINGS; ++i) {
+        EventRing* ring = RINGS[i].load(std::memory_order_acquire);
+        if (!ring) {
+            continue;
+        }
+        std::uint32_t state = ring->state.load(std::memory_order_acquire);
+        std::uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        std::uint64_t head = ring->head.load(std::memory_order_acquire);
+        while (tail != head) { // in at most two pieces because of the wrap-around
+            std::size_t first = tail & (RING_EVENTS - 1);
+            std::size_t count = head - tail < RING_EVENTS - first ? head - tail : RING_EVENTS - first;
+            append_events(ring->events + first, count);
+            tail += count;
+        }
+        ring->tail.store(tail, std::memory_order_release);
+        if (state == RING_EXITED) {
+            ring->state.compare_exchange_strong(state, RING_FREE, std::memory_order_release);
+        }
+        dropped += ring->dropped.load(std::memory_order_relaxed);
+    }
+    trace_file.header.dropped = dropped;
+    trace_file.header.end_tsc = read_tsc();
+    trace_file.header.end_ns = monotonic_ns();
+    pwrite(trace_file.fd, &trace_file.header, sizeof(trace_file.header), 0);
+}
+
+// The drain thread and the file belong to the parent, a forked child is not traced. exec() starts a new
+// trace.
+static void stop_in_child() {
+    TRACE_ENABLED = false;
+}
+
+static void* drain_thread(void*) {
+    TRACER_THREAD = true;
+    while (!DRAIN_STOP.load(std::memory_order_acquire)) {
+        drain_rings();
+        timespec interval = {0, DRAIN_INTERVAL_NS};
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+__attribute__((constructor)) static void start_event_trace() {
+    const char* path = getenv("MALLOC_TRACER_TRACE_FILE");
+    if (!path) {
+        return;
+    }
+    if (const char* ringEvents = getenv("MALLOC_TRACER_TRACE_RING")) {
+        long long events = strtoll(ringEvents, NULL, 10);
+        if (events <= 0 || (events & (events - 1)) != 0) {
+            fprintf(stderr, "Error: MALLOC_TRACER_TRACE_RING=%s is not a power of two\n", ringEvents);
+            exit(1);
+        }
+        RING_EVENTS = events;
+    }
+    // one file per process: children inherit the environment and would truncate the file of their parent
+    char fileName[PATH_MAX];
+    snprintf(fileName, sizeof(fileName), "%s.%d", path, getpid());
+    trace_file.fd = open(fileName, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_file.fd < 0 || pthread_key_create(&RING_KEY, release_ring) != 0 ||
+        pthread_atfork(NULL, NULL, stop_in_child) != 0) {
+        fprintf(stderr, "Error: cannot open trace file %s: %s\n", fileName, strerror(errno));
+        exit(1);
+    }
+    TraceFileHeader& header = trace_file.header;
+    memcpy(header.magic, "MTTRACE", 8);
+    header.version = 1;
+    header.event_size = sizeof(TraceEvent);
+    header.footer_format = MALLOC_TRACER_FOOTER_FORMAT;
+    header.start_tsc = header.end_tsc = read_tsc();
+    header.start_ns = header.end_ns = monotonic_ns();
+    pwrite(trace_file.fd, &header, sizeof(header), 0);
+    TRACE_ENABLED = true;
+    if (!start_tracer_thread(&DRAIN_THREAD, drain_thread, NULL)) {
+        fprintf(stderr, "Error: cannot start the trace drain thread\n");
+        exit(1);
+    }
+}
+
+// Events of threads still running after this point are lost.
+__attribute__((destructor)) static void stop_event_trace() {
+    if (!TRACE_ENABLED) {
+        return;
+    }
+    DRAIN_STOP.store(true, std::memory_order_release);
+    pthread_join(DRAIN_THREAD, NULL);
+    TRACE_ENABLED = false;
+    drain_rings();
+    if (trace_file.window) {
+        tracer_munmap(trace_file.window, TRACE_WINDOW_SIZE);
+    }
+    ftruncate(trace_file.fd, trace_file.size);
+    close(trace_file.fd);
+}
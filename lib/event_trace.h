@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "tsc.h"
+
+enum class TraceOp : std::uint32_t {
+    ALLOC = 1,
+    FREE = 2,
+    REALLOC = 3, // an allocation that replaces old_ptr
+};
+
+// Fixed-size record of the trace file. `site` is the footer site, see allocation_site().
+struct TraceEvent {
+    std::uint64_t tsc;
+    std::uint64_t ptr;
+    std::uint64_t old_ptr;
+    std::uint64_t size;
+    std::uint64_t site;
+    std::uint32_t thread;
+    TraceOp       op;
+};
+
+// Header at the start of the trace file, TraceEvents follow it. The tsc/ns pairs taken when the trace starts
+// and at every drain convert event timestamps to CLOCK_MONOTONIC nanoseconds.
+struct TraceFileHeader {
+    char          magic[8]; // "MTTRACE"
+    std::uint32_t version;
+    std::uint32_t event_size;
+    std::uint32_t footer_format; // MALLOC_TRACER_FOOTER_FORMAT, tells what `site` is
+    std::uint32_t reserved;
+    std::uint64_t start_tsc;
+    std::uint64_t start_ns;
+    std::uint64_t end_tsc;
+    std::uint64_t end_ns;
+    std::uint64_t events;
+    std::uint64_t dropped; // events lost because a ring was full or no ring was left
+};
+
+// Appends an event to the ring of the current thread. Never blocks, never makes a syscall except for
+// mapping the ring on the first event of a thread. Does nothing unless MALLOC_TRACER_TRACE_FILE is set.
+void trace_event(TraceOp op, void* ptr, void* old_ptr, std::size_t size, std::uintptr_t site);
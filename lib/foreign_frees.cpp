@@ -0,0 +1,66 @@
+#include "foreign_frees.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+
+#include "malloc_tracer.h"
+#include "report.h"
+#include "tracer_memory.h"
+
+constexpr std::size_t REPORT_SITES = FOREIGN_FREE_TABLE_SIZE + 1; // with the overflow record
+
+ForeignFreeTable FOREIGN_FREES;
+
+static ExitReport foreign_free_report; // MALLOC_TRACER_FOREIGN_FREE_REPORT
+
+extern "C" size_t malloc_tracer_foreign_frees(malloc_tracer_foreign_free* out, size_t max_count) {
+    size_t count = 0;
+    for (const auto& stats : FOREIGN_FREES.sites) {
+        std::uintptr_t site = stats.site.load(std::memory_order_acquire);
+        if (site == 0) {
+            continue;
+        }
+        if (count < max_count) {
+            out[count] = {site, stats.count.load(std::memory_order_relaxed)};
+        }
+        ++count;
+    }
+    std::int64_t overflow = FOREIGN_FREES.overflow.load(std::memory_order_relaxed);
+    if (overflow != 0) {
+        if (count < max_count) {
+            out[count] = {0, overflow};
+        }
+        ++count;
+    }
+    return count;
+}
+
+static void write_report(int fd) {
+    auto* sites = static_cast<malloc_tracer_foreign_free*>(
+        map_tracer_memory(REPORT_SITES * sizeof(malloc_tracer_foreign_free)));
+    if (!sites) {
+        return;
+    }
+    std::size_t  count = std::min(malloc_tracer_foreign_frees(sites, REPORT_SITES), REPORT_SITES);
+    std::int64_t frees = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        frees += sites[i].count;
+    }
+    std::sort(sites, sites + count, [](const auto& a, const auto& b) { return a.count > b.count; });
+    dprintf(fd, "# %ld frees of blocks without a valid footer from %zu sites\n", frees, count);
+    dprintf(fd, "%10s  %s\n", "frees", "site");
+    for (std::size_t i = 0; i < count; ++i) {
+        dprintf(fd, "%10ld", sites[i].count);
+        print_site(fd, sites[i].ret_addr);
+    }
+    tracer_munmap(sites, REPORT_SITES * sizeof(malloc_tracer_foreign_free));
+}
+
+__attribute__((constructor)) static void start_foreign_frees() {
+    foreign_free_report.start("MALLOC_TRACER_FOREIGN_FREE_REPORT");
+}
+
+__attribute__((destructor)) static void write_foreign_free_report() {
+    foreign_free_report.finish(write_report);
+}
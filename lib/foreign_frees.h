@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+constexpr std::size_t FOREIGN_FREE_TABLE_SIZE = 1 << 12; // must be a power of two
+constexpr std::size_t FOREIGN_FREE_MAX_PROBES = 64;
+
+struct ForeignFreeStats {
+    std::atomic_uintptr_t site{0}; // 0 - free slot
+    std::atomic_int64_t   count{0};
+};
+
+// Frees of blocks whose footer check does not match (TURN_ON_FOOTER_CHECK), keyed by the return address of
+// the free() call: the blocks were allocated before the tracer was loaded, by an untraced path, or their
+// footer was overwritten. Slots are claimed with a CAS on the site and never released, sites that do not fit
+// in FOREIGN_FREE_MAX_PROBES slots are counted in `overflow`.
+struct ForeignFreeTable {
+    ForeignFreeStats    sites[FOREIGN_FREE_TABLE_SIZE];
+    std::atomic_int64_t overflow{0};
+
+    void on_free(std::uintptr_t site) {
+        if (site == 0) {
+            overflow.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        std::size_t idx = (site * 0x9E3779B97F4A7C15ull) >> (64 - __builtin_ctzll(FOREIGN_FREE_TABLE_SIZE));
+        for (std::size_t probe = 0; probe < FOREIGN_FREE_MAX_PROBES; ++probe) {
+            ForeignFreeStats& slot = sites[(idx + probe) & (FOREIGN_FREE_TABLE_SIZE - 1)];
+            std::uintptr_t    key = slot.site.load(std::memory_order_relaxed);
+            if (key == 0 && slot.site.compare_exchange_strong(key, site, std::memory_order_relaxed)) {
+                key = site;
+            }
+            if (key == site) {
+                slot.count.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        }
+        overflow.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+extern ForeignFreeTable FOREIGN_FREES;
@@ -0,0 +1,334 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "callsite_table.h"
+#include "malloc_tracer.h"
+#include "pprof_writer.h"
+#include "stack_trace.h"
+#include "tracer_memory.h"
+#include "tracer_thread.h"
+
+constexpr std::size_t DUMP_CALLSITES = CALLSITE_TABLE_SIZE + 1; // with the overflow record
+constexpr std::size_t DUMP_BUFFER_SIZE = 1 << 16;
+constexpr int         DUMP_CLIENT_TIMEOUT_SEC = 1; // a silent client must not stall the dump thread
+
+// Everything the dump thread needs is allocated at startup: a profile is written with write() from a
+// static buffer and sorted in tracer-owned memory, so a dump never calls the hooked malloc.
+static struct HeapDump {
+    int                     pipe[2] = {-1, -1}; // the signal handler wakes the dump thread through it
+    int                     socket = -1;
+    int                     signal = 0;
+    const char*             prefix = "malloc_tracer";
+    char                    socket_path[sizeof(sockaddr_un::sun_path)] = {};
+    unsigned                count = 0;
+    bool                    pprof = false; // MALLOC_TRACER_DUMP_FORMAT=pprof
+    bool                    owner = false; // false in forked children
+    pthread_t               thread{};
+    malloc_tracer_callsite* callsites = nullptr;
+} heap_dump;
+
+static struct DumpWriter {
+    int         fd = -1;
+    std::size_t used = 0;
+    char        buffer[DUMP_BUFFER_SIZE] = {};
+} writer;
+
+static void flush_dump() {
+    for (std::size_t done = 0; done < writer.used;) {
+        ssize_t written = write(writer.fd, writer.buffer + done, writer.used - done);
+        if (written <= 0 && errno != EINTR) {
+            break;
+        }
+        done += written > 0 ? written : 0;
+    }
+    writer.used = 0;
+}
+
+__attribute__((format(printf, 1, 2))) static void print_dump(const char* fmt, ...) {
+    if (DUMP_BUFFER_SIZE - writer.used < 512) {
+        flush_dump();
+    }
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(writer.buffer + writer.used, DUMP_BUFFER_SIZE - writer.used, fmt, args);
+    va_end(args);
+    writer.used += std::min<std::size_t>(len > 0 ? len : 0, DUMP_BUFFER_SIZE - writer.used - 1);
+}
+
+static void copy_maps() {
+    int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    flush_dump();
+    ssize_t len;
+    while ((len = read(fd, writer.buffer, DUMP_BUFFER_SIZE)) > 0) {
+        writer.used = len;
+        flush_dump();
+    }
+    close(fd);
+}
+
+static std::size_t collect_callsites() {
+    return std::min(malloc_tracer_callsites(heap_dump.callsites, DUMP_CALLSITES), DUMP_CALLSITES);
+}
+
+// Writes the live heap in the legacy gperftools heap profile format understood by pprof: one
+// "live_count: live_bytes [total_count: total_bytes] @ frames" line per site, then the memory map for
+// symbolization. Sampled counts are already scaled, so no sampling rate is declared.
+static bool write_profile(const char* path) {
+    writer.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (writer.fd < 0) {
+        return false;
+    }
+    std::size_t count = collect_callsites();
+    std::sort(heap_dump.callsites, heap_dump.callsites + count,
+              [](const auto& a, const auto& b) { return a.live_bytes > b.live_bytes; });
+    malloc_tracer_callsite total{};
+    for (std::size_t i = 0; i < count; ++i) {
+        total.live_count += heap_dump.callsites[i].live_count;
+        total.live_bytes += heap_dump.callsites[i].live_bytes;
+        total.total_count += heap_dump.callsites[i].total_count;
+        total.total_bytes += heap_dump.callsites[i].total_bytes;
+    }
+    print_dump("heap profile: %6ld: %8ld [%6ld: %8ld] @ heapprofile\n", total.live_count, total.live_bytes,
+               total.total_count, total.total_bytes);
+    for (std::size_t i = 0; i < count; ++i) {
+        const malloc_tracer_callsite& site = heap_dump.callsites[i];
+        if (site.ret_addr == 0) {
+            continue; // sites lost to a full table have no address
+        }
+        print_dump("%6ld: %8ld [%6ld: %8ld] @", site.live_count, site.live_bytes, site.total_count,
+                   site.total_bytes);
+#ifdef TURN_ON_STACK_IDS
+        std::uintptr_t frames[STACK_TRACE_MAX_DEPTH];
+        std::size_t    depth = std::min<std::size_t>(
+            malloc_tracer_stack(site.stack_id, frames, STACK_TRACE_MAX_DEPTH), STACK_TRACE_MAX_DEPTH);
+        for (std::size_t frame = 0; frame < depth; ++frame) {
+            print_dump(" %#lx", frames[frame]);
+        }
+        if (depth == 0) {
+            print_dump(" %#lx", site.ret_addr);
+        }
+#else
+        print_dump(" %#lx", site.ret_addr);
+#endif
+        print_dump("\n");
+    }
+    print_dump("\nMAPPED_LIBRARIES:\n");
+    copy_maps();
+    close(writer.fd);
+    return true;
+}
+
+static bool write_pprof(const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool written = write_pprof_profile(fd, heap_dump.callsites, collect_callsites());
+    close(fd);
+    return written;
+}
+
+// Returns the name of the written profile, or an empty string.
+static const char* dump_profile(char* path, std::size_t size, bool pprof) {
+    snprintf(path, size, "%s.%d.%04u.%s", heap_dump.prefix, getpid(), heap_dump.count++,
+             pprof ? "pb" : "heap");
+    if (!(pprof ? write_pprof(path) : write_profile(path))) {
+        fprintf(stderr, "malloc_tracer: cannot write heap profile %s: %s\n", path, strerror(errno));
+        path[0] = '\0';
+    }
+    return path;
+}
+
+// A client sends a line, "pprof" for a pprof profile or anything else, e.g. "dump", for the default format,
+// and gets the name of the written profile back.
+static void serve_client(int client) {
+    timeval timeout = {DUMP_CLIENT_TIMEOUT_SEC, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    char    command[64];
+    ssize_t len;
+    do {
+        len = read(client, command, sizeof(command));
+    } while (len < 0 && errno == EINTR);
+    if (len < 0) {
+        fprintf(stderr, "malloc_tracer: no heap dump request from the client: %s\n", strerror(errno));
+    } else if (len > 0) {
+        bool pprof = heap_dump.pprof || (len >= 5 && strncmp(command, "pprof", 5) == 0);
+        char path[PATH_MAX];
+        dump_profile(path, sizeof(path) - 1, pprof);
+        std::size_t pathLen = strlen(path);
+        path[pathLen] = '\n';
+        write(client, path, pathLen + 1);
+    }
+    close(client);
+}
+
+// Closes the control socket after an error that would wake the dump thread again and again. Signals still
+// trigger dumps.
+static void stop_listening(const char* error) {
+    fprintf(stderr, "malloc_tracer: heap dump socket %s closed: %s\n", heap_dump.socket_path, error);
+    close(heap_dump.socket);
+    heap_dump.socket = -1;
+    unlink(heap_dump.socket_path);
+    heap_dump.socket_path[0] = '\0';
+}
+
+static void* dump_thread(void*) {
+    TRACER_THREAD = true;
+    pollfd fds[2] = {{heap_dump.pipe[0], POLLIN, 0}, {heap_dump.socket, POLLIN, 0}};
+    for (;;) {
+        if (poll(fds, heap_dump.socket >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "malloc_tracer: heap dump thread stopped: poll: %s\n", strerror(errno));
+            return NULL;
+        }
+        if (fds[0].revents & POLLIN) {
+            char command = 0;
+            if (read(heap_dump.pipe[0], &command, 1) == 1 && command == 'q') {
+                return NULL;
+            }
+            char path[PATH_MAX];
+            dump_profile(path, sizeof(path), heap_dump.pprof);
+        }
+        if (heap_dump.socket < 0) {
+            continue;
+        }
+        if (fds[1].revents & (POLLERR | POLLNVAL)) {
+            stop_listening("poll error");
+        } else if (fds[1].revents & POLLIN) {
+            int client = accept4(heap_dump.socket, NULL, NULL, SOCK_CLOEXEC);
+            if (client >= 0) {
+                serve_client(client);
+            } else if (errno != EINTR && errno != ECONNABORTED) {
+                stop_listening(strerror(errno));
+            }
+        }
+    }
+}
+
+static void on_dump_signal(int) {
+    int savedErrno = errno;
+    if (heap_dump.owner) {
+        char command = 'd';
+        write(heap_dump.pipe[1], &command, 1);
+    }
+    errno = savedErrno;
+}
+
+// The dump thread does not exist in a forked child: it ignores the trigger and leaves the socket alone.
+static void stop_in_child() {
+    heap_dump.owner = false;
+}
+
+static int parse_signal(const char* name) {
+    if (name[0] >= '0' && name[0] <= '9') {
+        return atoi(name);
+    }
+    if (strncmp(name, "SIG", 3) == 0) {
+        name += 3;
+    }
+    for (int sig = 1; sig < NSIG; ++sig) {
+        const char* abbrev = sigabbrev_np(sig);
+        if (abbrev && strcmp(abbrev, name) == 0) {
+            return sig;
+        }
+    }
+    return 0;
+}
+
+// Listens on <path>.<pid>: children inherit the environment and would take over the socket of their parent.
+static bool listen_socket(const char* path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    int len = snprintf(address.sun_path, sizeof(address.sun_path), "%s.%d", path, getpid());
+    if (len < 0 || static_cast<std::size_t>(len) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    heap_dump.socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(address.sun_path);
+    if (heap_dump.socket < 0 ||
+        bind(heap_dump.socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        listen(heap_dump.socket, 4) != 0) {
+        return false;
+    }
+    strcpy(heap_dump.socket_path, address.sun_path);
+    return true;
+}
+
+__attribute__((constructor)) static void start_heap_dump() {
+    const char* signalName = getenv("MALLOC_TRACER_DUMP_SIGNAL");
+    const char* socketPath = getenv("MALLOC_TRACER_DUMP_SOCKET");
+    if (!signalName && !socketPath) {
+        return;
+    }
+    if (const char* prefix = getenv("MALLOC_TRACER_DUMP_FILE")) {
+        heap_dump.prefix = prefix;
+    }
+    if (const char* format = getenv("MALLOC_TRACER_DUMP_FORMAT")) {
+        if (strcmp(format, "pprof") != 0 && strcmp(format, "text") != 0) {
+            fprintf(stderr, "Error: bad MALLOC_TRACER_DUMP_FORMAT=%s, expected text or pprof\n", format);
+            exit(1);
+        }
+        heap_dump.pprof = strcmp(format, "pprof") == 0;
+    }
+    heap_dump.callsites = static_cast<malloc_tracer_callsite*>(
+        map_tracer_memory(DUMP_CALLSITES * sizeof(malloc_tracer_callsite)));
+    if (!heap_dump.callsites || pipe2(heap_dump.pipe, O_CLOEXEC) != 0) {
+        fprintf(stderr, "Error: no memory for heap dumps: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (signalName) {
+        heap_dump.signal = parse_signal(signalName);
+        struct sigaction action = {};
+        action.sa_handler = on_dump_signal;
+        action.sa_flags = SA_RESTART;
+        if (heap_dump.signal <= 0 || heap_dump.signal >= NSIG ||
+            sigaction(heap_dump.signal, &action, NULL) != 0) {
+            fprintf(stderr, "Error: bad MALLOC_TRACER_DUMP_SIGNAL=%s\n", signalName);
+            exit(1);
+        }
+    }
+    if (socketPath && !listen_socket(socketPath)) {
+        fprintf(stderr, "Error: cannot listen on MALLOC_TRACER_DUMP_SOCKET=%s: %s\n", socketPath,
+                strerror(errno));
+        exit(1);
+    }
+    heap_dump.owner = true;
+    if (pthread_atfork(NULL, NULL, stop_in_child) != 0 ||
+        !start_tracer_thread(&heap_dump.thread, dump_thread, NULL)) {
+        fprintf(stderr, "Error: cannot start the heap dump thread\n");
+        exit(1);
+    }
+}
+
+__attribute__((destructor)) static void stop_heap_dump() {
+    if (!heap_dump.owner) {
+        return;
+    }
+    heap_dump.owner = false;
+    char command = 'q';
+    write(heap_dump.pipe[1], &command, 1);
+    pthread_join(heap_dump.thread, NULL);
+    if (heap_dump.socket_path[0]) {
+        unlink(heap_dump.socket_path);
+    }
+}
@@ -0,0 +1,163 @@
+#include "latency.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "backend.h"
+#include "callsite_table.h"
+#include "malloc_tracer.h"
+#include "report.h"
+
+constexpr std::uint64_t CALIBRATION_NS = 1000000;
+constexpr const char*   OP_NAMES[OP_COUNT] = {"malloc", "calloc", "realloc", "memalign", "free"};
+
+LatencyHistograms LATENCY;
+std::uint64_t     SLOW_CALL_TICKS = 0;
+
+static ExitReport latency_report; // MALLOC_TRACER_LATENCY_REPORT
+static double     SLOW_CALL_NS = 0; // MALLOC_TRACER_SLOW_ALLOC_NS
+
+struct SlowSite {
+    malloc_tracer_callsite site;
+    std::int64_t           slow_calls;
+    std::uint64_t          max_call_ticks;
+};
+
+// The slow call threshold is compared in ticks, so the tick rate is needed before the first call.
+static double measure_ns_per_tick() {
+    std::uint64_t startNs = monotonic_ns();
+    std::uint64_t startTsc = read_tsc();
+    std::uint64_t ns;
+    while ((ns = monotonic_ns() - startNs) < CALIBRATION_NS) {
+    }
+    std::uint64_t ticks = read_tsc() - startTsc;
+    return ticks == 0 ? 1.0 : static_cast<double>(ns) / ticks;
+}
+
+static double bucket_ns(unsigned bucket, double nsPerTick) {
+    return static_cast<double>(2ull << bucket) * nsPerTick;
+}
+
+// Prints calls, p50, p99, p99.9 and max of a histogram. Percentiles are bucket upper bounds.
+static void print_histogram(int fd, const std::int64_t* buckets, double nsPerTick) {
+    std::int64_t calls = 0;
+    for (unsigned i = 0; i < LATENCY_BUCKETS; ++i) {
+        calls += buckets[i];
+    }
+    dprintf(fd, " %12ld", calls);
+    for (double share : {0.5, 0.99, 0.999, 1.0}) {
+        std::int64_t seen = 0;
+        unsigned     bucket = 0;
+        for (; bucket < LATENCY_BUCKETS - 1 && (seen += buckets[bucket]) < share * calls; ++bucket) {
+        }
+        char text[32];
+        format_ns(text, sizeof(text), bucket_ns(bucket, nsPerTick));
+        dprintf(fd, " %8s", text);
+    }
+    dprintf(fd, "\n");
+}
+
+static void size_class_name(unsigned sizeClass, char* out, std::size_t size) {
+    std::size_t floor = std::size_t(8) << sizeClass;
+    const char* plus = sizeClass + 1 == LATENCY_SIZE_CLASSES ? "+" : "";
+    if (sizeClass == 0) {
+        snprintf(out, size, "<16");
+    } else if (floor < 1024) {
+        snprintf(out, size, "%zu%s", floor, plus);
+    } else if (floor < 1024 * 1024) {
+        snprintf(out, size, "%zuK%s", floor / 1024, plus);
+    } else {
+        snprintf(out, size, "%zuM%s", floor / (1024 * 1024), plus);
+    }
+}
+
+static void write_slow_sites(int fd, double nsPerTick) {
+    write_callsite_rows<SlowSite>(
+        fd,
+        [](SlowSite& row) {
+            const CallsiteStats* stats = CALLSITE_TABLE.find(callsite_key(row.site));
+            if (!stats) {
+                return false;
+            }
+            row.slow_calls = stats->slow_calls.load(std::memory_order_relaxed);
+            row.max_call_ticks = stats->max_call_ticks.load(std::memory_order_relaxed);
+            return row.slow_calls > 0;
+        },
+        [](const SlowSite& a, const SlowSite& b) { return a.slow_calls > b.slow_calls; },
+        [](int fd, const SlowSite*, std::size_t count) {
+            char threshold[32];
+            format_ns(threshold, sizeof(threshold), SLOW_CALL_NS);
+            dprintf(fd, "\n# %zu sites of traced allocations slower than %s\n", count, threshold);
+            dprintf(fd, "%10s %8s  %s\n", "slow", "max", "site");
+        },
+        [nsPerTick](int fd, const SlowSite& row) {
+            char max[32];
+            format_ns(max, sizeof(max), row.max_call_ticks * nsPerTick);
+            dprintf(fd, "%10ld %8s", row.slow_calls, max);
+        });
+}
+
+static void write_report(int fd) {
+    double nsPerTick = malloc_tracer_ns_per_tick();
+    dprintf(fd, "# %s call latency by operation and size class, %.3f ns per tick\n", Backend::NAME,
+            nsPerTick);
+    dprintf(fd, "%-8s %6s %12s %8s %8s %8s %8s\n", "op", "size", "calls", "p50", "p99", "p99.9", "max");
+    for (unsigned op = 0; op < OP_COUNT; ++op) {
+        for (unsigned sizeClass = 0; sizeClass < LATENCY_SIZE_CLASSES; ++sizeClass) {
+            std::int64_t buckets[LATENCY_BUCKETS] = {};
+            std::int64_t calls = 0;
+            for (const auto& shard : LATENCY.counts) {
+                for (unsigned i = 0; i < LATENCY_BUCKETS; ++i) {
+                    std::int64_t value = shard[op][sizeClass][i].load(std::memory_order_relaxed);
+                    buckets[i] += value;
+                    calls += value;
+                }
+            }
+            if (calls == 0) {
+                continue;
+            }
+            char name[16];
+            size_class_name(sizeClass, name, sizeof(name));
+            dprintf(fd, "%-8s %6s", OP_NAMES[op], name);
+            print_histogram(fd, buckets, nsPerTick);
+        }
+    }
+    dprintf(fd, "\n# by thread shard, all operations\n");
+    dprintf(fd, "%-15s %12s %8s %8s %8s %8s\n", "shard", "calls", "p50", "p99", "p99.9", "max");
+    for (std::size_t shard = 0; shard < COUNTER_SHARDS; ++shard) {
+        std::int64_t buckets[LATENCY_BUCKETS] = {};
+        std::int64_t calls = 0;
+        for (const auto& op : LATENCY.counts[shard]) {
+            for (const auto& sizeClass : op) {
+                for (unsigned i = 0; i < LATENCY_BUCKETS; ++i) {
+                    std::int64_t value = sizeClass[i].load(std::memory_order_relaxed);
+                    buckets[i] += value;
+                    calls += value;
+                }
+            }
+        }
+        if (calls != 0) {
+            dprintf(fd, "%-15zu", shard);
+            print_histogram(fd, buckets, nsPerTick);
+        }
+    }
+    if (SLOW_CALL_TICKS != 0) {
+        write_slow_sites(fd, nsPerTick);
+    }
+}
+
+__attribute__((constructor)) static void start_latency() {
+    latency_report.start("MALLOC_TRACER_LATENCY_REPORT");
+    if (const char* slowNs = getenv("MALLOC_TRACER_SLOW_ALLOC_NS")) {
+        SLOW_CALL_NS = strtod(slowNs, NULL);
+        if (SLOW_CALL_NS <= 0) {
+            fprintf(stderr, "Error: bad MALLOC_TRACER_SLOW_ALLOC_NS=%s\n", slowNs);
+            exit(1);
+        }
+        SLOW_CALL_TICKS = static_cast<std::uint64_t>(SLOW_CALL_NS / measure_ns_per_tick()) + 1;
+    }
+}
+
+__attribute__((destructor)) static void write_latency_report() {
+    latency_report.finish(write_report);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#include "sharded_counter.h"
+#include "tsc.h"
+
+enum AllocOp : unsigned { OP_MALLOC, OP_CALLOC, OP_REALLOC, OP_MEMALIGN, OP_FREE, OP_COUNT };
+
+constexpr unsigned LATENCY_SIZE_CLASSES = 24; // below 16 bytes, then powers of two, from 64 MiB up
+constexpr unsigned LATENCY_BUCKETS = 32;      // log2 of the call duration in read_tsc() ticks
+
+// Latency histograms of the underlying allocator calls per counter shard (a thread as long as there are no
+// more than COUNTER_SHARDS threads), operation and request size class.
+struct LatencyHistograms {
+    std::atomic_int64_t counts[COUNTER_SHARDS][OP_COUNT][LATENCY_SIZE_CLASSES][LATENCY_BUCKETS];
+};
+
+extern LatencyHistograms LATENCY;
+extern std::uint64_t     SLOW_CALL_TICKS; // MALLOC_TRACER_SLOW_ALLOC_NS in ticks, 0 - no slow call tracking
+
+// Duration of the last allocator call of the thread, record_alloc() attributes a slow call to its site.
+inline thread_local std::uint64_t LAST_CALL_TICKS TRACER_TLS = 0;
+
+inline unsigned latency_size_class(std::size_t size) {
+    unsigned log2 = 63 - __builtin_clzll(size | 1);
+    return log2 < 4 ? 0 : (log2 - 3 < LATENCY_SIZE_CLASSES ? log2 - 3 : LATENCY_SIZE_CLASSES - 1);
+}
+
+inline unsigned latency_bucket(std::uint64_t ticks) {
+    unsigned log2 = 63 - __builtin_clzll(ticks | 1);
+    return log2 < LATENCY_BUCKETS ? log2 : LATENCY_BUCKETS - 1;
+}
+
+inline void record_call(AllocOp op, std::size_t size, std::uint64_t start) {
+    std::uint64_t end = read_tsc();
+    LAST_CALL_TICKS = end > start ? end - start : 0;
+    LATENCY.counts[thread_shard()][op][latency_size_class(size)][latency_bucket(LAST_CALL_TICKS)].fetch_add(
+        1, std::memory_order_relaxed);
+}
+
+// Runs an allocator call and records its duration.
+template <typename Call>
+inline auto timed_call(AllocOp op, std::size_t size, Call call) {
+    std::uint64_t start = read_tsc();
+    if constexpr (std::is_void_v<decltype(call())>) {
+        call();
+        record_call(op, size, start);
+    } else {
+        auto result = call();
+        record_call(op, size, start);
+        return result;
+    }
+}
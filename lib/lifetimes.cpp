@@ -0,0 +1,97 @@
+#include <stdio.h>
+
+#include "callsite_table.h"
+#include "malloc_tracer.h"
+#include "report.h"
+
+constexpr double SHORT_LIFETIME_NS[] = {1e3, 1e4, 1e5, 1e6};
+
+static ExitReport lifetime_report; // MALLOC_TRACER_LIFETIME_REPORT
+
+struct LifetimeRow {
+    malloc_tracer_callsite site;
+    std::int64_t           buckets[MALLOC_TRACER_LIFETIME_BUCKETS];
+    std::int64_t           frees;
+    std::int64_t           short_frees; // frees before SHORT_LIFETIME_NS[0]
+};
+
+extern "C" int malloc_tracer_lifetimes(const malloc_tracer_callsite* site, int64_t* buckets) {
+    const CallsiteStats* stats = CALLSITE_TABLE.find(callsite_key(*site));
+    if (!stats) {
+        return 0;
+    }
+    const CallsiteHistograms* histograms = stats->histograms.load(std::memory_order_acquire);
+    for (std::size_t i = 0; i < MALLOC_TRACER_LIFETIME_BUCKETS; ++i) {
+        buckets[i] = histograms ? histograms->lifetimes[i].load(std::memory_order_relaxed) : 0;
+    }
+    return 1;
+}
+
+// Upper bound of the lifetime bucket that holds the given share of the frees.
+static double percentile_ns(const LifetimeRow& row, double share, double nsPerTick) {
+    std::int64_t seen = 0;
+    for (std::size_t i = 0; i < MALLOC_TRACER_LIFETIME_BUCKETS; ++i) {
+        seen += row.buckets[i];
+        if (seen >= share * row.frees) {
+            return static_cast<double>(2ull << i) * nsPerTick;
+        }
+    }
+    return static_cast<double>(2ull << (MALLOC_TRACER_LIFETIME_BUCKETS - 1)) * nsPerTick;
+}
+
+// Frees of blocks whose whole lifetime bucket is below ns.
+static std::int64_t frees_below(const LifetimeRow& row, double ns, double nsPerTick) {
+    std::int64_t frees = 0;
+    for (std::size_t i = 0; i < MALLOC_TRACER_LIFETIME_BUCKETS && (2ull << i) * nsPerTick <= ns; ++i) {
+        frees += row.buckets[i];
+    }
+    return frees;
+}
+
+static void print_row(int fd, const LifetimeRow& row, double nsPerTick) {
+    dprintf(fd, "%10ld", row.frees);
+    for (double ns : SHORT_LIFETIME_NS) {
+        dprintf(fd, " %6.1f%%", 100.0 * frees_below(row, ns, nsPerTick) / row.frees);
+    }
+    char p50[32];
+    char p99[32];
+    format_ns(p50, sizeof(p50), percentile_ns(row, 0.5, nsPerTick));
+    format_ns(p99, sizeof(p99), percentile_ns(row, 0.99, nsPerTick));
+    dprintf(fd, " %8s %8s", p50, p99);
+}
+
+// Sites with frees, most short-lived frees first. Percentages count whole buckets only, so they are lower
+// bounds, and percentiles are bucket upper bounds.
+static void write_report(int fd) {
+    double nsPerTick = malloc_tracer_ns_per_tick();
+    write_callsite_rows<LifetimeRow>(
+        fd,
+        [nsPerTick](LifetimeRow& row) {
+            if (!malloc_tracer_lifetimes(&row.site, row.buckets)) {
+                return false;
+            }
+            row.frees = 0;
+            for (std::int64_t frees : row.buckets) {
+                row.frees += frees;
+            }
+            row.short_frees = frees_below(row, SHORT_LIFETIME_NS[0], nsPerTick);
+            return row.frees > 0;
+        },
+        [](const LifetimeRow& a, const LifetimeRow& b) {
+            return a.short_frees != b.short_frees ? a.short_frees > b.short_frees : a.frees > b.frees;
+        },
+        [nsPerTick](int fd, const LifetimeRow*, std::size_t count) {
+            dprintf(fd, "# block lifetimes of %zu sites, %.3f ns per tick\n", count, nsPerTick);
+            dprintf(fd, "%10s %7s %7s %7s %7s %8s %8s  %s\n", "frees", "<1us", "<10us", "<100us", "<1ms",
+                    "p50", "p99", "site");
+        },
+        [nsPerTick](int fd, const LifetimeRow& row) { print_row(fd, row, nsPerTick); });
+}
+
+__attribute__((constructor)) static void start_lifetimes() {
+    lifetime_report.start("MALLOC_TRACER_LIFETIME_REPORT");
+}
+
+__attribute__((destructor)) static void write_lifetime_report() {
+    lifetime_report.finish(write_report);
+}
@@ -1,9 +1,13 @@
 #include <dlfcn.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-#include <cassert>
+#include <atomic>
 #include <cstdint>
 #include <exception>
 #include <new>
@@ -12,6 +16,20 @@
 #include <sys/mman.h>
 #include <unistd.h>
 
+#include "address_map.h"
+#include "backend.h"
+#include "bootstrap_arena.h"
+#include "callsite_table.h"
+#include "event_trace.h"
+#include "foreign_frees.h"
+#include "latency.h"
+#include "mmap_stats.h"
+#include "sampler.h"
+#include "sharded_counter.h"
+#include "stack_trace.h"
+#include "tracer_thread.h"
+#include "tsc.h"
+
 //#define DEBUG 1
 //#define TURN_ON_MALLOC_COUNTERS 1
 
@@ -25,185 +43,968 @@
 #endif
 
 #ifdef TURN_ON_MALLOC_COUNTERS
-#    include <atomic>
-std::atomic_int64_t TOTAL_ALLOCS = 0;
-std::atomic_int64_t TOTAL_ALLOCATED_BYTES = 0;
+constexpr std::uint32_t COUNTER_FOLD_INTERVAL = 1024;
+
+ShardedCounter TOTAL_ALLOC_SHARDS;
+ShardedCounter TOTAL_ALLOCATED_BYTE_SHARDS;
+// Sums of the shards for plain gdb: `print TOTAL_ALLOCS` in a core. A thread folds them every
+// COUNTER_FOLD_INTERVAL of its counter updates, so they lag behind the shards by less than that per thread.
+std::int64_t TOTAL_ALLOCS = 0;
+std::int64_t TOTAL_ALLOCATED_BYTES = 0;
+
+static thread_local std::uint32_t THREAD_COUNTER_UPDATES TRACER_TLS = 0;
+
+static void fold_counters() {
+    __atomic_store_n(&TOTAL_ALLOCS, TOTAL_ALLOC_SHARDS.load(), __ATOMIC_RELAXED);
+    __atomic_store_n(&TOTAL_ALLOCATED_BYTES, TOTAL_ALLOCATED_BYTE_SHARDS.load(), __ATOMIC_RELAXED);
+}
+
+static void add_to_counters(std::int64_t count, std::int64_t bytes) {
+    TOTAL_ALLOC_SHARDS.add(count);
+    TOTAL_ALLOCATED_BYTE_SHARDS.add(bytes);
+    if (++THREAD_COUNTER_UPDATES % COUNTER_FOLD_INTERVAL == 0) {
+        fold_counters();
+    }
+}
+
+extern "C" int64_t malloc_tracer_total_allocs(void) {
+    fold_counters();
+    return TOTAL_ALLOCS;
+}
+
+extern "C" int64_t malloc_tracer_total_allocated_bytes(void) {
+    fold_counters();
+    return TOTAL_ALLOCATED_BYTES;
+}
+#endif
+
+#if defined(TURN_ON_MALLOC_COUNTERS) || defined(TURN_ON_CALLSITE_STATS) || defined(TURN_ON_EVENT_TRACE)
+#    define TRACK_FREES 1
+#endif
+
+#if defined(TURN_ON_EVENT_TRACE) || defined(TURN_ON_SHM_STATS) || defined(TURN_ON_HEAP_DUMP)
+#    define HAS_TRACER_THREADS 1
+#endif
+
+#ifdef TURN_ON_EVENT_TRACE
+#    define TRACE_EVENT(...) trace_event(__VA_ARGS__)
+#else
+#    define TRACE_EVENT(...)
+#endif
+
+// LINK_TIME_WRAP builds the hooks as __wrap_malloc() and so on for statically linked binaries linked with
+// -Wl,--wrap=malloc,..., the linker passes the real functions as __real_malloc() and so on.
+#ifdef LINK_TIME_WRAP
+#    define HOOK(name) __wrap_##name
+#else
+#    define HOOK(name) name
+#endif
+
+// Calls the underlying allocator, measuring the call with TURN_ON_ALLOC_LATENCY. size is not evaluated
+// otherwise.
+#ifdef TURN_ON_ALLOC_LATENCY
+#    define ALLOCATOR_CALL(op, size, call) timed_call(op, size, [&] { return call; })
+#else
+#    define ALLOCATOR_CALL(op, size, call) (call)
 #endif
 
-static struct FirstAllocation {
-    char          buff[8096];
-    unsigned long pos = 0;
-    unsigned long allocs = 0;
-} first_alloc;
+// Sampling mode: only allocations that cover a sample point get a footer and statistics.
+// Side-table mode (MALLOC_TRACER_SIDE_TABLE): traced blocks get no footer, so chunk sizes are the same as
+// in an untraced run. TRACED_BLOCKS keeps the attribution of sampled blocks, or of all traced blocks in
+// side-table mode, and tells free() which blocks those are.
+constexpr std::size_t TRACED_BLOCKS_BUCKETS = 1 << 15;
+std::int64_t          SAMPLE_RATE = 0;
+bool                  METADATA_IN_SIDE_TABLE = false; // read by gdb_plugin/gdb_malloc_tracer
+static bool           BLOCKS_IN_MAP = false;
+AddressMap            TRACED_BLOCKS;
 
+// The real allocator is resolved by the first allocation. Until then mem_func_orig holds the bootstrap_*
+// functions, which resolve it and forward, or serve the calls made while it is being resolved from
+// BOOTSTRAP_ARENA. The hooks themselves never check whether it is resolved.
+enum HookState : int { HOOKS_UNRESOLVED, HOOKS_RESOLVING, HOOKS_READY };
+static std::atomic_int HOOK_STATE{HOOKS_UNRESOLVED};
+static thread_local bool RESOLVING_THREAD TRACER_TLS = false;
+static BootstrapArena    BOOTSTRAP_ARENA;
+
+#if defined(TURN_ON_COMPACT_FOOTER)
+// The site in the low 48 bits and the slack between the user data and the footer in the high 16 bits, the
+// size is malloc_usable_size() - 8 - slack. A slack of FOOTER_SLACK_ESCAPE or more is stored as the escape
+// value and the size is kept in the 8 bytes before the footer, which are part of that slack.
+struct BlockFooter {
+#    ifdef TURN_ON_FOOTER_CHECK
+    std::uint64_t check; // footer_check()
+#    endif
+#    ifdef TURN_ON_LIFETIMES
+    std::uint64_t alloc_tsc;
+#    endif
+    std::uint64_t site_and_slack;
+};
+constexpr std::uint64_t FOOTER_SITE_MASK = (1ull << 48) - 1;
+constexpr std::uint64_t FOOTER_SLACK_ESCAPE = 0xFFFF;
+#elif defined(TURN_ON_STACK_IDS)
+struct BlockFooter {
+#    ifdef TURN_ON_FOOTER_CHECK
+    std::uint64_t check; // footer_check()
+#    endif
+#    ifdef TURN_ON_LIFETIMES
+    std::uint64_t alloc_tsc;
+#    endif
+    std::uint32_t stack_id; // STACK_TABLE id
+    std::uint32_t reserved;
+    std::size_t   alloc_size;
+};
+#else
 struct BlockFooter {
+#    ifdef TURN_ON_FOOTER_CHECK
+    std::uint64_t check; // footer_check()
+#    endif
+#    ifdef TURN_ON_LIFETIMES
+    std::uint64_t alloc_tsc;
+#    endif
     std::uintptr_t ret_addr;
     std::size_t    alloc_size;
 };
+#endif
+
+#ifdef TURN_ON_STACK_IDS
+constexpr std::uint32_t FOOTER_SITE_FORMAT = 2;
+#else
+constexpr std::uint32_t FOOTER_SITE_FORMAT = 1;
+#endif
+
+#ifdef TURN_ON_COMPACT_FOOTER
+constexpr std::uint32_t FOOTER_LAYOUT_FORMAT = FOOTER_SITE_FORMAT + 2;
+#else
+constexpr std::uint32_t FOOTER_LAYOUT_FORMAT = FOOTER_SITE_FORMAT;
+#endif
+
+// Read by gdb_plugin/gdb_malloc_tracer to decode footers: 1 - return address, 2 - STACK_TABLE id,
+// 3 and 4 - the same in the compact footer. FOOTER_TIMESTAMP_FLAG is set when footers have alloc_tsc and
+// FOOTER_CHECK_FLAG when they start with check.
+constexpr std::uint32_t FOOTER_TIMESTAMP_FLAG = 0x10;
+constexpr std::uint32_t FOOTER_CHECK_FLAG = 0x20;
+#ifdef TURN_ON_LIFETIMES
+constexpr std::uint32_t FOOTER_TIMESTAMP_BITS = FOOTER_TIMESTAMP_FLAG;
+#else
+constexpr std::uint32_t FOOTER_TIMESTAMP_BITS = 0;
+#endif
+#ifdef TURN_ON_FOOTER_CHECK
+constexpr std::uint32_t FOOTER_CHECK_BITS = FOOTER_CHECK_FLAG;
+#else
+constexpr std::uint32_t FOOTER_CHECK_BITS = 0;
+#endif
+std::uint32_t MALLOC_TRACER_FOOTER_FORMAT = FOOTER_LAYOUT_FORMAT | FOOTER_TIMESTAMP_BITS | FOOTER_CHECK_BITS;
 
 using MallocFunc_t = void* (*)(size_t size);
 using CallocFunc_t = void* (*)(size_t elements, size_t size);
 using FreeFunc_t = void* (*)(void* ptr);
 using ReallocFunc_t = void* (*)(void* ptr, size_t size);
 using MemalignFunc_t = void* (*)(size_t blocksize, size_t bytes);
-using VallocFunc_t = void* (*)(size_t size);
-using PosixMemalignFunc_t = int (*)(void** memptr, size_t alignment, size_t size);
 
+static void* bootstrap_malloc(size_t size);
+static void* bootstrap_calloc(size_t elements, size_t size);
+static void* bootstrap_free(void* ptr);
+static void* bootstrap_realloc(void* ptr, size_t size);
+static void* bootstrap_memalign(size_t blocksize, size_t bytes);
+
+// All the aligned functions are served by memalign(), see aligned_impl().
 static struct MemoryFunctions {
-    MallocFunc_t        malloc;
-    CallocFunc_t        calloc;
-    FreeFunc_t          free;
-    ReallocFunc_t       realloc;
-    MemalignFunc_t      memalign;
-    VallocFunc_t        valloc;
-    PosixMemalignFunc_t posix_memalign;
-} mem_func_orig;
+    MallocFunc_t   malloc;
+    CallocFunc_t   calloc;
+    FreeFunc_t     free;
+    ReallocFunc_t  realloc;
+    MemalignFunc_t memalign;
+} mem_func_orig = {bootstrap_malloc, bootstrap_calloc, bootstrap_free, bootstrap_realloc, bootstrap_memalign};
+
+#ifdef LINK_TIME_WRAP
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t elements, size_t size);
+void  __real_free(void* ptr);
+void* __real_realloc(void* ptr, size_t size);
+void* __real_memalign(size_t blocksize, size_t bytes);
+}
+
+static void bind_wrapped_functions(MemoryFunctions* real) {
+    real->malloc = __real_malloc;
+    real->calloc = __real_calloc;
+    real->free = reinterpret_cast<FreeFunc_t>(reinterpret_cast<void*>(__real_free));
+    real->realloc = __real_realloc;
+    real->memalign = __real_memalign;
+}
+#else
+// glibc exports its allocator under these names as well. Binding them takes no dlsym(), which allocates and
+// looks every function up by name.
+extern "C" {
+void* __libc_malloc(size_t size) __attribute__((weak));
+void* __libc_calloc(size_t elements, size_t size) __attribute__((weak));
+void  __libc_free(void* ptr) __attribute__((weak));
+void* __libc_realloc(void* ptr, size_t size) __attribute__((weak));
+void* __libc_memalign(size_t blocksize, size_t bytes) __attribute__((weak));
+}
+
+static bool bind_libc_functions(MemoryFunctions* real) {
+    if (!__libc_malloc || !__libc_calloc || !__libc_free || !__libc_realloc || !__libc_memalign) {
+        return false;
+    }
+    real->malloc = __libc_malloc;
+    real->calloc = __libc_calloc;
+    real->free = reinterpret_cast<FreeFunc_t>(reinterpret_cast<void*>(__libc_free)); // as dlsym() gives it
+    real->realloc = __libc_realloc;
+    real->memalign = __libc_memalign;
+    return true;
+}
+
+static void resolve_next_functions(MemoryFunctions* real) {
+    real->malloc = reinterpret_cast<MallocFunc_t>(dlsym(RTLD_NEXT, "malloc"));
+    real->calloc = reinterpret_cast<CallocFunc_t>(dlsym(RTLD_NEXT, "calloc"));
+    real->free = reinterpret_cast<FreeFunc_t>(dlsym(RTLD_NEXT, "free"));
+    real->realloc = reinterpret_cast<ReallocFunc_t>(dlsym(RTLD_NEXT, "realloc"));
+    real->memalign = reinterpret_cast<MemalignFunc_t>(dlsym(RTLD_NEXT, "memalign"));
+
+    if (!real->malloc || !real->calloc || !real->free || !real->realloc || !real->memalign) {
+        fprintf(stderr, "Error in `dlsym`: %s\n", dlerror());
+        exit(1);
+    }
+}
+#endif
 
 // __attribute__((constructor))
 static void __lib_hook_init(void) {
-    // M_CHECK_ACTION: If bit 0 is set, then print a one-line message on stderr
-    // that provides details about the error. Program won't be terminated by
-    // calling abort and program will continue execution
-    mallopt(M_CHECK_ACTION, 1);
-    mem_func_orig.malloc = reinterpret_cast<MallocFunc_t>(dlsym(RTLD_NEXT, "malloc"));
-    mem_func_orig.calloc = reinterpret_cast<CallocFunc_t>(dlsym(RTLD_NEXT, "calloc"));
-    mem_func_orig.free = reinterpret_cast<FreeFunc_t>(dlsym(RTLD_NEXT, "free"));
-    mem_func_orig.realloc = reinterpret_cast<ReallocFunc_t>(dlsym(RTLD_NEXT, "realloc"));
-    mem_func_orig.posix_memalign = reinterpret_cast<PosixMemalignFunc_t>(dlsym(RTLD_NEXT, "posix_memalign"));
-    mem_func_orig.memalign = reinterpret_cast<MemalignFunc_t>(dlsym(RTLD_NEXT, "memalign"));
-    mem_func_orig.valloc = reinterpret_cast<VallocFunc_t>(dlsym(RTLD_NEXT, "valloc"));
-
-    if (!mem_func_orig.malloc || !mem_func_orig.calloc || !mem_func_orig.free || !mem_func_orig.realloc ||
-        !mem_func_orig.posix_memalign || !mem_func_orig.memalign || !mem_func_orig.valloc) {
-        fprintf(stderr, "Error in `dlsym`: %s\n", dlerror());
+#ifdef TURN_ON_STACK_TRACES
+    init_stack_traces();
+#endif
+    std::size_t tracedBlocksBuckets = TRACED_BLOCKS_BUCKETS;
+    if (const char* sideTable = getenv("MALLOC_TRACER_SIDE_TABLE")) {
+        long long liveBlocks = strtoll(sideTable, NULL, 10);
+        if (liveBlocks <= 0) {
+            fprintf(stderr, "Error: bad MALLOC_TRACER_SIDE_TABLE=%s\n", sideTable);
+            exit(1);
+        }
+        METADATA_IN_SIDE_TABLE = true;
+        while (tracedBlocksBuckets * 4 < static_cast<unsigned long long>(liveBlocks)) {
+            tracedBlocksBuckets *= 2; // about half of the slots are used
+        }
+    }
+    if (const char* sampleRate = getenv("MALLOC_TRACER_SAMPLE_RATE")) {
+        SAMPLE_RATE = strtoll(sampleRate, NULL, 10);
+        if (SAMPLE_RATE < 0) {
+            fprintf(stderr, "Error: bad MALLOC_TRACER_SAMPLE_RATE=%s\n", sampleRate);
+            exit(1);
+        }
+    }
+#ifdef TRACK_FREES
+    BLOCKS_IN_MAP = SAMPLE_RATE > 0 || METADATA_IN_SIDE_TABLE;
+#else
+    BLOCKS_IN_MAP = METADATA_IN_SIDE_TABLE;
+#endif
+    if (BLOCKS_IN_MAP && !TRACED_BLOCKS.init(tracedBlocksBuckets)) {
+        fprintf(stderr, "Error: no memory for the traced blocks map\n");
         exit(1);
     }
+    // MALLOC_TRACER_DLSYM traces on top of an allocator preloaded after this library instead of glibc's
+    MemoryFunctions real;
+    bool            resolvedByName = false;
+#ifdef LINK_TIME_WRAP
+    bind_wrapped_functions(&real);
+#else
+    if (!Backend::HAS_LIBC_SYMBOLS || getenv("MALLOC_TRACER_DLSYM") || !bind_libc_functions(&real)) {
+        resolve_next_functions(&real);
+        resolvedByName = true;
+    }
+#endif
+    Backend::init(resolvedByName);
+    // Other threads may read the table meanwhile, every entry works before and after its store.
+    std::atomic_thread_fence(std::memory_order_release);
+    mem_func_orig = real;
+}
+
+// True once the real allocator is resolved. The first caller resolves it, callers that come meanwhile get
+// false: dlsym() allocating on the resolving thread with MALLOC_TRACER_DLSYM, or other threads.
+static bool resolve_hooks() {
+    int state = HOOK_STATE.load(std::memory_order_acquire);
+    if (state == HOOKS_READY) {
+        return true;
+    }
+    if (state != HOOKS_UNRESOLVED ||
+        !HOOK_STATE.compare_exchange_strong(state, HOOKS_RESOLVING, std::memory_order_acq_rel)) {
+        return false;
+    }
+    RESOLVING_THREAD = true;
+    __lib_hook_init();
+    RESOLVING_THREAD = false;
+    HOOK_STATE.store(HOOKS_READY, std::memory_order_release);
+    return true;
 }
 
-void* try_place_footer(void* ptr, void* ret_addr, size_t size) {
+// Blocks of the real allocator reach free() and realloc() before the table is swapped only on other threads,
+// they wait for the resolving thread to finish.
+static void wait_for_hooks() {
+    while (HOOK_STATE.load(std::memory_order_acquire) != HOOKS_READY) {
+        sched_yield();
+    }
+}
+
+static void* bootstrap_allocate(size_t size, size_t alignment) {
+    void* ptr = BOOTSTRAP_ARENA.allocate(size, alignment);
     if (!ptr) {
-        return NULL;
+        fprintf(stderr, "Error: %zu bytes requested while the allocator is resolved, the bootstrap arena is "
+                        "exhausted\n",
+                size);
+        exit(1);
     }
-    size_t allocatedSize = malloc_usable_size(ptr);
-    char*  footerPtr = static_cast<char*>(ptr) + (allocatedSize - sizeof(BlockFooter));
-    new (footerPtr) BlockFooter{reinterpret_cast<std::uintptr_t>(ret_addr), size};
     return ptr;
 }
 
-static void* malloc_impl(size_t size, void* ret_addr) {
-    static int initializing = 0;
-    if (mem_func_orig.malloc == NULL) {
-        if (!initializing) {
-            initializing = 1;
-            __lib_hook_init();
-            initializing = 0;
-        } else if (first_alloc.pos + size < sizeof(first_alloc.buff)) {
-            void* ret_ptr = first_alloc.buff + first_alloc.pos;
-            first_alloc.pos += size;
-            ++first_alloc.allocs;
-            return ret_ptr;
-        } else {
-            fprintf(stderr, "check: too much memory requested during "
-                            "initialisation - increase first_alloc.buff size\n");
-            exit(1);
-        }
+static void* bootstrap_malloc(size_t size) {
+    return resolve_hooks() ? mem_func_orig.malloc(size) : bootstrap_allocate(size, BootstrapArena::HEADER);
+}
+
+static void* bootstrap_calloc(size_t elements, size_t size) {
+    if (resolve_hooks()) {
+        return mem_func_orig.calloc(elements, size);
+    }
+    size_t bytes;
+    if (__builtin_mul_overflow(elements, size, &bytes)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return bootstrap_allocate(bytes, BootstrapArena::HEADER); // arena blocks are zero already
+}
+
+static void* bootstrap_free(void* ptr) {
+    if (RESOLVING_THREAD) {
+        return NULL; // the real free() is not known yet, the block leaks
+    }
+    wait_for_hooks();
+    return mem_func_orig.free(ptr);
+}
+
+static void* bootstrap_realloc(void* ptr, size_t size) {
+    if (RESOLVING_THREAD) {
+        fprintf(stderr, "Error: realloc() of a foreign block while the allocator is resolved\n");
+        exit(1);
     }
+    wait_for_hooks();
+    return mem_func_orig.realloc(ptr, size);
+}
+
+static void* bootstrap_memalign(size_t blocksize, size_t bytes) {
+    if (resolve_hooks()) {
+        return mem_func_orig.memalign(blocksize, bytes);
+    }
+    if (blocksize & (blocksize - 1)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return bootstrap_allocate(bytes, blocksize);
+}
+
+static BlockFooter* get_footer(void* ptr, size_t allocatedSize) {
+    return reinterpret_cast<BlockFooter*>(static_cast<char*>(ptr) + (allocatedSize - sizeof(BlockFooter)));
+}
+
+#ifdef TURN_ON_FOOTER_CHECK
+constexpr std::uint64_t FOOTER_CHECK_SEED = 0x6D616C6C6F635F74ull;
+constexpr std::uint64_t FOOTER_CHECK_MULTIPLIER = 0x9E3779B97F4A7C15ull;
+static_assert(offsetof(BlockFooter, check) == 0 && sizeof(BlockFooter) % sizeof(std::uint64_t) == 0);
+
+// Hash of the block address and the footer words after check, with the escaped size of a compact footer.
+// Stale data, a footer of another block and a partly overwritten footer do not match it.
+static std::uint64_t footer_check(const void* ptr, const BlockFooter* footer) {
+    std::uint64_t words[sizeof(BlockFooter) / sizeof(std::uint64_t)];
+    memcpy(words, footer, sizeof(words));
+    std::uint64_t hash = reinterpret_cast<std::uintptr_t>(ptr) ^ FOOTER_CHECK_SEED;
+    for (size_t i = 1; i < sizeof(words) / sizeof(words[0]); ++i) {
+        hash = (hash ^ words[i]) * FOOTER_CHECK_MULTIPLIER;
+    }
+#    ifdef TURN_ON_COMPACT_FOOTER
+    if ((footer->site_and_slack >> 48) == FOOTER_SLACK_ESCAPE) {
+        hash = (hash ^ reinterpret_cast<const std::uint64_t*>(footer)[-1]) * FOOTER_CHECK_MULTIPLIER;
+    }
+#    endif
+    return hash ^ (hash >> 29);
+}
+
+// False for blocks that did not get a footer from the tracer, or whose footer was overwritten.
+static bool footer_matches(void* ptr, size_t allocatedSize) {
+    if (allocatedSize < sizeof(BlockFooter)) {
+        return false;
+    }
+    const BlockFooter* footerPtr = get_footer(ptr, allocatedSize);
+    return footerPtr->check == footer_check(ptr, footerPtr);
+}
+#endif
+
+static void write_footer(void* ptr, const BlockInfo& info) {
+    size_t allocatedSize = Backend::usable_size(ptr);
+    auto*  footerPtr = get_footer(ptr, allocatedSize);
+#if defined(TURN_ON_COMPACT_FOOTER)
+    std::uint64_t slack = allocatedSize - sizeof(BlockFooter) - info.alloc_size;
+    if (slack >= FOOTER_SLACK_ESCAPE) {
+        reinterpret_cast<std::uint64_t*>(footerPtr)[-1] = info.alloc_size;
+        slack = FOOTER_SLACK_ESCAPE;
+    }
+    footerPtr->site_and_slack = (slack << 48) | (info.site & FOOTER_SITE_MASK);
+#elif defined(TURN_ON_STACK_IDS)
+    footerPtr->stack_id = static_cast<std::uint32_t>(info.site);
+    footerPtr->reserved = 0;
+    footerPtr->alloc_size = info.alloc_size;
+#else
+    footerPtr->ret_addr = info.site;
+    footerPtr->alloc_size = info.alloc_size;
+#endif
+#ifdef TURN_ON_LIFETIMES
+    footerPtr->alloc_tsc = info.alloc_tsc;
+#endif
+#ifdef TURN_ON_FOOTER_CHECK
+    footerPtr->check = footer_check(ptr, footerPtr);
+#endif
+}
+
+[[maybe_unused]] static BlockInfo read_footer(void* ptr, size_t allocatedSize) {
+    auto* footerPtr = get_footer(ptr, allocatedSize);
+#if defined(TURN_ON_COMPACT_FOOTER)
+    std::uint64_t slack = footerPtr->site_and_slack >> 48;
+    size_t        size = slack == FOOTER_SLACK_ESCAPE ? reinterpret_cast<std::uint64_t*>(footerPtr)[-1]
+                                                      : allocatedSize - sizeof(BlockFooter) - slack;
+    BlockInfo info{footerPtr->site_and_slack & FOOTER_SITE_MASK, size};
+#elif defined(TURN_ON_STACK_IDS)
+    BlockInfo info{footerPtr->stack_id, footerPtr->alloc_size};
+#else
+    BlockInfo info{footerPtr->ret_addr, footerPtr->alloc_size};
+#endif
+#ifdef TURN_ON_LIFETIMES
+    info.alloc_tsc = footerPtr->alloc_tsc;
+#endif
+    return info;
+}
+
+// Decides whether a new allocation gets a footer and statistics.
+static bool is_traced(size_t size) {
+#ifdef HAS_TRACER_THREADS
+    if (TRACER_THREAD) {
+        return false;
+    }
+#endif
+    // before SAMPLE_RATE and footer_size(): the first allocation reads their variables in __lib_hook_init()
+    resolve_hooks();
+    return SAMPLE_RATE == 0 || should_sample(size);
+}
+
+// Extra bytes requested for a traced allocation.
+static size_t footer_size() {
+    return METADATA_IN_SIDE_TABLE ? 0 : sizeof(BlockFooter);
+}
+
+// old_ptr and old_size describe the block reallocated into ptr, if any. A block the map has no room for
+// stays untraced with its footer, free_impl() then stops passing sizes of untraced blocks to sized_free().
+static void record_alloc([[maybe_unused]] void* ptr, [[maybe_unused]] const BlockInfo& info,
+                         [[maybe_unused]] void* old_ptr, [[maybe_unused]] size_t old_size) {
+    if (BLOCKS_IN_MAP && !TRACED_BLOCKS.insert(reinterpret_cast<std::uintptr_t>(ptr), info)) {
+        return;
+    }
+#ifdef TRACK_FREES
+    [[maybe_unused]] SampleWeight weight =
+        sample_weight(reinterpret_cast<std::uintptr_t>(ptr), info.alloc_size);
+#endif
 #ifdef TURN_ON_MALLOC_COUNTERS
-    TOTAL_ALLOCS.fetch_add(1, std::memory_order_relaxed);
-    TOTAL_ALLOCATED_BYTES.fetch_add(size, std::memory_order_relaxed);
+    add_to_counters(weight.count, weight.bytes);
+#endif
+#ifdef TURN_ON_CALLSITE_STATS
+    [[maybe_unused]] CallsiteStats* stats = CALLSITE_TABLE.on_alloc(info.site, weight.count, weight.bytes);
+#endif
+#ifdef TURN_ON_SIZE_HISTOGRAMS
+    stats->on_size(info.alloc_size, weight.count);
+#endif
+#ifdef TURN_ON_ALLOC_LATENCY
+    if (SLOW_CALL_TICKS != 0 && LAST_CALL_TICKS >= SLOW_CALL_TICKS) {
+        stats->on_slow_call(LAST_CALL_TICKS);
+    }
+#endif
+#ifdef TURN_ON_REALLOC_STATS
+    if (old_ptr) {
+        bool moved = ptr != old_ptr;
+        size_t copied = old_size < info.alloc_size ? old_size : info.alloc_size;
+        stats->on_realloc(moved, moved ? copied : 0, weight.count);
+    }
 #endif
-    void* dataPtr = mem_func_orig.malloc(size + sizeof(BlockFooter));
-    return try_place_footer(dataPtr, ret_addr, size);
 }
 
-extern "C" {
-void* memset(void*, int, size_t);
+// Takes the attribution of a block back. Returns false for a block that was not traced, and for footers when
+// frees are not tracked. ret_addr is the caller of free() or realloc(), blocks with a footer that does not
+// match are counted for it.
+static bool take_block_info([[maybe_unused]] void* ptr, [[maybe_unused]] BlockInfo* info,
+                            [[maybe_unused]] void* ret_addr) {
+    if (BLOCKS_IN_MAP) {
+        return TRACED_BLOCKS.remove(reinterpret_cast<std::uintptr_t>(ptr), info);
+    }
+#ifdef TRACK_FREES
+    size_t allocatedSize = Backend::usable_size(ptr);
+#    ifdef TURN_ON_FOOTER_CHECK
+    if (!footer_matches(ptr, allocatedSize)) {
+        FOREIGN_FREES.on_free(reinterpret_cast<std::uintptr_t>(ret_addr));
+        return false;
+    }
+    get_footer(ptr, allocatedSize)->check = 0; // a later block in the same memory must not match it
+#    endif
+    *info = read_footer(ptr, allocatedSize);
+    return true;
+#else
+    return false;
+#endif
+}
 
-void* malloc(size_t size) {
-    auto  ret_addr = __builtin_return_address(0);
-    void* ptr = malloc_impl(size, ret_addr);
+static void record_free([[maybe_unused]] void* ptr, [[maybe_unused]] const BlockInfo& info) {
+#ifdef TRACK_FREES
+    [[maybe_unused]] SampleWeight weight =
+        sample_weight(reinterpret_cast<std::uintptr_t>(ptr), info.alloc_size);
+#endif
+#ifdef TURN_ON_MALLOC_COUNTERS
+    add_to_counters(-weight.count, -weight.bytes);
+#endif
+#ifdef TURN_ON_CALLSITE_STATS
+    [[maybe_unused]] CallsiteStats* stats = CALLSITE_TABLE.on_free(info.site, weight.count, weight.bytes);
+#endif
+#ifdef TURN_ON_LIFETIMES
+    std::uint64_t now = read_tsc();
+    if (stats) {
+        stats->on_lifetime(now > info.alloc_tsc ? now - info.alloc_tsc : 0, weight.count);
+    }
+#endif
+}
+
+// Key of the caller in footers and CALLSITE_TABLE.
+static std::uintptr_t site_of(void* ret_addr) {
+#ifdef TURN_ON_STACK_TRACES
+    return allocation_site(reinterpret_cast<std::uintptr_t>(ret_addr));
+#else
+    return reinterpret_cast<std::uintptr_t>(ret_addr);
+#endif
+}
+
+// old_ptr and old_size describe the block reallocated into ptr, if any.
+void* try_place_footer(void* ptr, void* ret_addr, size_t size, void* old_ptr = NULL, size_t old_size = 0) {
+    if (!ptr || BOOTSTRAP_ARENA.contains(ptr)) {
+        return ptr;
+    }
+    std::uintptr_t site = site_of(ret_addr);
+    BlockInfo      info{site, size};
+#ifdef TURN_ON_LIFETIMES
+    info.alloc_tsc = read_tsc();
+#endif
+    if (!METADATA_IN_SIDE_TABLE) {
+        write_footer(ptr, info);
+    }
+    record_alloc(ptr, info, old_ptr, old_size);
+    TRACE_EVENT(old_ptr ? TraceOp::REALLOC : TraceOp::ALLOC, ptr, old_ptr, size, site);
     return ptr;
 }
 
-void free(void* ptr) {
-    assert(mem_func_orig.malloc != NULL);
+// The footer must not wrap the request around.
+static bool footer_fits(size_t size) {
+    if (size > SIZE_MAX - sizeof(BlockFooter)) {
+        errno = ENOMEM;
+        return false;
+    }
+    return true;
+}
+
+static void* malloc_impl(size_t size, void* ret_addr) {
+    if (!is_traced(size)) {
+        return ALLOCATOR_CALL(OP_MALLOC, size, mem_func_orig.malloc(size));
+    }
+    if (!footer_fits(size)) {
+        return NULL;
+    }
+    void* dataPtr = ALLOCATOR_CALL(OP_MALLOC, size, mem_func_orig.malloc(size + footer_size()));
+    return try_place_footer(dataPtr, ret_addr, size);
+}
+
+// The aligned functions: the footer goes after the requested bytes, at the end of the usable size as for
+// malloc(), and the start of the block keeps the alignment.
+static void* aligned_impl(size_t alignment, size_t size, void* ret_addr) {
+    if (!is_traced(size)) {
+        return ALLOCATOR_CALL(OP_MEMALIGN, size, mem_func_orig.memalign(alignment, size));
+    }
+    if (!footer_fits(size)) {
+        return NULL;
+    }
+    size_t bytes = size + footer_size();
+    void*  dataPtr = ALLOCATOR_CALL(OP_MEMALIGN, size, mem_func_orig.memalign(alignment, bytes));
+    return try_place_footer(dataPtr, ret_addr, size);
+}
+
+// size is the requested size of the block when the caller knows it, as sized operator delete does, or 0.
+static void free_impl(void* ptr, size_t size, void* ret_addr) {
     if (!ptr) {
         return;
     }
-    if (ptr >= reinterpret_cast<void*>(first_alloc.buff) &&
-        ptr <= reinterpret_cast<void*>(first_alloc.buff + first_alloc.pos)) {
-        DEBUG_PRINT("free. first_alloc.buf\n");
+    if (BOOTSTRAP_ARENA.contains(ptr)) {
+        DEBUG_PRINT("free. bootstrap arena\n");
         return;
     }
-#ifdef TURN_ON_MALLOC_COUNTERS
-    TOTAL_ALLOCS.fetch_sub(1, std::memory_order_relaxed);
-    size_t       allocatedSize = malloc_usable_size(ptr);
-    BlockFooter* footerPtr =
-        reinterpret_cast<BlockFooter*>(static_cast<char*>(ptr) + (allocatedSize - sizeof(BlockFooter)));
-    TOTAL_ALLOCATED_BYTES.fetch_sub(footerPtr->alloc_size, std::memory_order_relaxed);
+    BlockInfo info;
+    bool      traced = take_block_info(ptr, &info, ret_addr);
+    if (traced) {
+        record_free(ptr, info);
+        TRACE_EVENT(TraceOp::FREE, ptr, NULL, info.alloc_size, info.site);
+    }
+    if (size == 0) {
+        ALLOCATOR_CALL(OP_FREE, Backend::usable_size(ptr), mem_func_orig.free(ptr));
+    } else if (Backend::HAS_SIZED_FREE && BLOCKS_IN_MAP &&
+               (traced || footer_size() == 0 || TRACED_BLOCKS.dropped.load(std::memory_order_relaxed) == 0)) {
+        // only the map tells blocks with a footer from the others, a block it dropped has one as well
+        ALLOCATOR_CALL(OP_FREE, size, Backend::sized_free(ptr, traced ? size + footer_size() : size));
+    } else {
+        ALLOCATOR_CALL(OP_FREE, size, mem_func_orig.free(ptr));
+    }
+}
+
+// Bytes at the end of the usable size of a block that the tracer keeps for itself.
+static size_t reserved_tail([[maybe_unused]] void* ptr, [[maybe_unused]] size_t usableSize) {
+    if (METADATA_IN_SIDE_TABLE) {
+        return 0;
+    }
+    BlockInfo info;
+    if (BLOCKS_IN_MAP && !TRACED_BLOCKS.find(reinterpret_cast<std::uintptr_t>(ptr), &info)) {
+        return 0;
+    }
+    if (SAMPLE_RATE > 0 && !BLOCKS_IN_MAP) {
+        return 0; // blocks with and without a footer cannot be told apart, the whole block is safer
+    }
+#ifdef TURN_ON_FOOTER_CHECK
+    if (!BLOCKS_IN_MAP && !footer_matches(ptr, usableSize)) {
+        return 0; // allocated before the tracer was loaded or by an untraced path
+    }
+#endif
+#ifdef TURN_ON_COMPACT_FOOTER
+    if ((get_footer(ptr, usableSize)->site_and_slack >> 48) == FOOTER_SLACK_ESCAPE) {
+        return sizeof(BlockFooter) + sizeof(std::uint64_t); // with the size kept before the footer
+    }
 #endif
-    mem_func_orig.free(ptr);
+    return usableSize >= sizeof(BlockFooter) ? sizeof(BlockFooter) : 0;
 }
 
-void* calloc(size_t nmemb, size_t size) {
-    DEBUG_PRINT("calloc\n");
-    auto  ret_addr = __builtin_return_address(0);
-    void* ptr = malloc_impl(nmemb * size, ret_addr);
-    if (ptr) {
-        memset(ptr, 0, nmemb * size);
+#ifdef TURN_ON_MMAP_STATS
+extern "C" void* __sbrk(intptr_t increment); // glibc's, moves the program break without the hook
+
+// The kernel maps and unmaps whole pages.
+static size_t page_length(size_t length) {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    return (length + pageSize - 1) & ~(pageSize - 1);
+}
+
+static void* mmap_impl(void* addr, size_t length, int prot, int flags, int fd, off_t offset, void* ret_addr) {
+    void* ptr = tracer_mmap(addr, length, prot, flags, fd, offset);
+    if (ptr != MAP_FAILED) {
+        auto start = reinterpret_cast<std::uintptr_t>(ptr);
+        if (flags & MAP_FIXED) {
+            forget_mappings(start, page_length(length)); // replaced by the new region
+        }
+        record_mapping(start, page_length(length), site_of(ret_addr));
+    }
+    return ptr;
+}
+
+static void* sbrk_impl(intptr_t increment, void* ret_addr) {
+    void* oldBreak = __sbrk(increment);
+    if (oldBreak != reinterpret_cast<void*>(-1)) {
+        auto start = reinterpret_cast<std::uintptr_t>(oldBreak);
+        if (increment > 0) {
+            record_mapping(start, increment, site_of(ret_addr));
+        } else if (increment < 0) {
+            forget_mappings(start + increment, -increment);
+        }
     }
+    return oldBreak;
+}
+#endif
+
+extern "C" {
+
+void* HOOK(malloc)(size_t size) {
+    auto  ret_addr = __builtin_return_address(0);
+    void* ptr = malloc_impl(size, ret_addr);
     return ptr;
 }
 
-void* realloc(void* ptr, size_t size) {
+void HOOK(free)(void* ptr) {
+    free_impl(ptr, 0, __builtin_return_address(0));
+}
+
+void* HOOK(calloc)(size_t nmemb, size_t size) {
+    DEBUG_PRINT("calloc\n");
+    auto   ret_addr = __builtin_return_address(0);
+    size_t bytes;
+    if (__builtin_mul_overflow(nmemb, size, &bytes) || bytes > SIZE_MAX - sizeof(BlockFooter)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (!is_traced(bytes)) {
+        return ALLOCATOR_CALL(OP_CALLOC, bytes, mem_func_orig.calloc(nmemb, size));
+    }
+    // the real calloc() keeps fresh mmap()ed pages untouched, they are zero already
+    void* dataPtr = ALLOCATOR_CALL(OP_CALLOC, bytes, mem_func_orig.calloc(1, bytes + footer_size()));
+    return try_place_footer(dataPtr, ret_addr, bytes);
+}
+
+void* HOOK(realloc)(void* ptr, size_t size) {
     auto ret_addr = __builtin_return_address(0);
     if (!ptr) {
         return malloc_impl(size, ret_addr);
     }
-    void* dataPtr = mem_func_orig.realloc(ptr, size + sizeof(BlockFooter));
-    return try_place_footer(dataPtr, ret_addr, size);
+    if (BOOTSTRAP_ARENA.contains(ptr)) { // moved to the real allocator
+        void* dataPtr = malloc_impl(size, ret_addr);
+        if (dataPtr) {
+            size_t oldSize = BOOTSTRAP_ARENA.size_of(ptr);
+            memcpy(dataPtr, ptr, oldSize < size ? oldSize : size);
+        }
+        return dataPtr;
+    }
+    bool traced = is_traced(size);
+    if (traced && !footer_fits(size)) {
+        return NULL; // before take_block_info(), the old block keeps its footer and map entry
+    }
+    size_t    footerSize = traced ? footer_size() : 0;
+    BlockInfo oldInfo;
+    bool      oldTraced = take_block_info(ptr, &oldInfo, ret_addr);
+    size_t    oldSize = 0;
+#ifdef TURN_ON_REALLOC_STATS
+    if (traced) {
+        oldSize = oldTraced ? oldInfo.alloc_size : Backend::usable_size(ptr);
+    }
+#endif
+    void*     dataPtr = ALLOCATOR_CALL(OP_REALLOC, size, mem_func_orig.realloc(ptr, size + footerSize));
+    if (oldTraced && (dataPtr || size + footerSize == 0)) {
+        record_free(ptr, oldInfo);
+        if (!traced || !dataPtr) { // otherwise the REALLOC event of the new block tells about the old one
+            TRACE_EVENT(TraceOp::FREE, ptr, NULL, oldInfo.alloc_size, oldInfo.site);
+        }
+    } else if (oldTraced && BLOCKS_IN_MAP) {
+        TRACED_BLOCKS.insert(reinterpret_cast<std::uintptr_t>(ptr), oldInfo); // the old block is still alive
+    } else if (oldTraced) {
+        write_footer(ptr, oldInfo); // still alive, take_block_info() may have cleared its check
+    }
+    return traced ? try_place_footer(dataPtr, ret_addr, size, ptr, oldSize) : dataPtr;
 }
 
-void* memalign(size_t blocksize, size_t bytes) {
-    auto ret_addr = __builtin_return_address(0);
-    auto ptr = mem_func_orig.memalign(blocksize, bytes);
-    return try_place_footer(ptr, ret_addr, bytes);
+void* HOOK(memalign)(size_t blocksize, size_t bytes) {
+    return aligned_impl(blocksize, bytes, __builtin_return_address(0));
 }
 
-int posix_memalign(void** memptr, size_t alignment, size_t size) {
-    auto ret_addr = __builtin_return_address(0);
-    auto rc = mem_func_orig.posix_memalign(memptr, alignment, size + sizeof(BlockFooter));
-    try_place_footer(*memptr, ret_addr, size);
-    return rc;
+void* HOOK(aligned_alloc)(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return aligned_impl(alignment, size, __builtin_return_address(0));
 }
 
-void* valloc(size_t size) {
-    auto ret_addr = __builtin_return_address(0);
-    auto ptr = mem_func_orig.valloc(size);
-    return try_place_footer(ptr, ret_addr, size);
+int HOOK(posix_memalign)(void** memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1))) {
+        return EINVAL;
+    }
+    int   savedErrno = errno; // posix_memalign() reports errors by the return value only
+    void* ptr = aligned_impl(alignment, size, __builtin_return_address(0));
+    if (!ptr) {
+        errno = savedErrno;
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
 }
-} // extern "C"
 
-void* operator new(size_t sz) {
-    DEBUG_PRINT("new(size_t), size = %zu\n", sz);
-    if (sz == 0) {
-        ++sz; // avoid std::malloc(0) which may return nullptr on success
+void* HOOK(valloc)(size_t size) {
+    return aligned_impl(sysconf(_SC_PAGESIZE), size, __builtin_return_address(0));
+}
+
+// The whole pages are usable, so the footer goes after them.
+void* HOOK(pvalloc)(size_t size) {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t pages = size / pageSize + (size % pageSize != 0 || size == 0);
+    if (pages > SIZE_MAX / pageSize) {
+        errno = ENOMEM;
+        return NULL;
     }
-    auto ret_addr = __builtin_return_address(0);
-    if (void* ptr = malloc_impl(sz, ret_addr)) {
-        return ptr;
+    return aligned_impl(pageSize, pages * pageSize, __builtin_return_address(0));
+}
+
+// Capacity-aware containers use the whole usable size of a block, so it excludes the footer.
+size_t HOOK(malloc_usable_size)(void* ptr) {
+    if (!ptr) {
+        return 0;
     }
-    throw std::bad_alloc();
+    if (BOOTSTRAP_ARENA.contains(ptr)) {
+        return BOOTSTRAP_ARENA.size_of(ptr);
+    }
+    size_t usableSize = Backend::usable_size(ptr);
+    return usableSize - reserved_tail(ptr, usableSize);
+}
+
+#ifdef TURN_ON_MMAP_STATS
+void* HOOK(mmap)(void* addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    return mmap_impl(addr, length, prot, flags, fd, offset, __builtin_return_address(0));
+}
+
+void* HOOK(mmap64)(void* addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    return mmap_impl(addr, length, prot, flags, fd, offset, __builtin_return_address(0));
 }
 
-void* operator new[](std::size_t sz) {
-    DEBUG_PRINT("new[](size_t), size = %zu\n", sz);
-    if (sz == 0) {
-        ++sz; // avoid std::malloc(0) which may return nullptr on success
+// The regions are forgotten first, so a region mapped at the same place by another thread meanwhile stays.
+int HOOK(munmap)(void* addr, size_t length) {
+    auto start = reinterpret_cast<std::uintptr_t>(addr);
+    if ((start & (sysconf(_SC_PAGESIZE) - 1)) == 0) {
+        forget_mappings(start, page_length(length));
     }
-    auto ret_addr = __builtin_return_address(0);
-    if (void* ptr = malloc_impl(sz, ret_addr)) {
-        return ptr;
+    return tracer_munmap(addr, length);
+}
+
+void* HOOK(mremap)(void* old_address, size_t old_size, size_t new_size, int flags, ...) {
+    void* newAddress = NULL;
+    if (flags & MREMAP_FIXED) {
+        va_list args;
+        va_start(args, flags);
+        newAddress = va_arg(args, void*);
+        va_end(args);
+    }
+    void* ptr = tracer_mremap(old_address, old_size, new_size, flags, newAddress);
+    if (ptr != MAP_FAILED) {
+        auto start = reinterpret_cast<std::uintptr_t>(ptr);
+        if (flags & MREMAP_FIXED) {
+            forget_mappings(start, page_length(new_size)); // replaced by the moved region
+        }
+#    ifdef MREMAP_DONTUNMAP
+        bool keepOld = flags & MREMAP_DONTUNMAP;
+#    else
+        bool keepOld = false;
+#    endif
+        record_remapping(reinterpret_cast<std::uintptr_t>(old_address), page_length(old_size), start,
+                         page_length(new_size), site_of(__builtin_return_address(0)), keepOld);
+    }
+    return ptr;
+}
+
+void* HOOK(sbrk)(intptr_t increment) {
+    return sbrk_impl(increment, __builtin_return_address(0));
+}
+
+int HOOK(brk)(void* addr) {
+    void* current = __sbrk(0);
+    if (current == reinterpret_cast<void*>(-1)) {
+        return -1;
+    }
+    intptr_t increment = static_cast<char*>(addr) - static_cast<char*>(current);
+    return sbrk_impl(increment, __builtin_return_address(0)) == reinterpret_cast<void*>(-1) ? -1 : 0;
+}
+#endif
+} // extern "C"
+
+// operator new: retries after the new handler, throws std::bad_alloc when there is none. alignment is 0 for
+// the unaligned versions.
+static void* new_impl(size_t size, size_t alignment, void* ret_addr) {
+    DEBUG_PRINT("new, size = %zu, alignment = %zu\n", size, alignment);
+    if (size == 0) {
+        ++size; // avoid std::malloc(0) which may return nullptr on success
+    }
+    for (;;) {
+        void* ptr = alignment ? aligned_impl(alignment, size, ret_addr) : malloc_impl(size, ret_addr);
+        if (ptr) {
+            return ptr;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            throw std::bad_alloc();
+        }
+        handler();
     }
-    throw std::bad_alloc{};
-}
\ No newline at end of file
+}
+
+static void* new_nothrow_impl(size_t size, size_t alignment, void* ret_addr) noexcept {
+    try {
+        return new_impl(size, alignment, ret_addr);
+    } catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void* operator new(std::size_t size) {
+    return new_impl(size, 0, __builtin_return_address(0));
+}
+
+void* operator new[](std::size_t size) {
+    return new_impl(size, 0, __builtin_return_address(0));
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    return new_nothrow_impl(size, 0, __builtin_return_address(0));
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return new_nothrow_impl(size, 0, __builtin_return_address(0));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    return new_impl(size, static_cast<size_t>(alignment), __builtin_return_address(0));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    return new_impl(size, static_cast<size_t>(alignment), __builtin_return_address(0));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return new_nothrow_impl(size, static_cast<size_t>(alignment), __builtin_return_address(0));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return new_nothrow_impl(size, static_cast<size_t>(alignment), __builtin_return_address(0));
+}
+
+void operator delete(void* ptr) noexcept {
+    free_impl(ptr, 0, __builtin_return_address(0));
+}
+
+void operator delete[](void* ptr) noexcept {
+    free_impl(ptr, 0, __builtin_return_address(0));
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    free_impl(ptr, 0, __builtin_return_address(0));
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    free_impl(ptr, 0, __builtin_return_address(0));
+}
+
+void operator delete(void* ptr, std::size_t size) noexcept {
+    free_impl(ptr, size, __builtin_return_address(0));
+}
+
+void operator delete[](void* ptr, std::size_t size) noexcept {
+    free_impl(ptr, size, __builtin_return_address(0));
+}
+
+// The sized free of a backend needs the alignment as well, aligned blocks are freed without the size.
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    free_impl(ptr, 0, __builtin_return_address(0));
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    free_impl(ptr, 0, __builtin_return_address(0));
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    free_impl(ptr, 0, __builtin_return_address(0));
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    free_impl(ptr, 0, __builtin_return_address(0));
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+    free_impl(ptr, 0, __builtin_return_address(0));
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept {
+    free_impl(ptr, 0, __builtin_return_address(0));
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+// Runtime API of libmalloc_tracer.so. Look the functions up with dlsym(RTLD_DEFAULT, ...) when the
+// library is LD_PRELOADed instead of being linked.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct malloc_tracer_callsite {
+    uintptr_t ret_addr;
+    int64_t   live_count;
+    int64_t   live_bytes;
+    int64_t   total_count;
+    int64_t   total_bytes;
+    uint32_t  stack_id; // TURN_ON_STACK_IDS=ON: stack of the site, see malloc_tracer_stack(). 0 otherwise
+};
+
+// Sums of the allocation counters (TURN_ON_MALLOC_COUNTERS=ON), also stored in TOTAL_ALLOCS and
+// TOTAL_ALLOCATED_BYTES. Never allocate, gdb can call them in a live process.
+int64_t malloc_tracer_total_allocs(void);
+int64_t malloc_tracer_total_allocated_bytes(void);
+
+// Copies up to max_count used callsite records (TURN_ON_CALLSITE_STATS=ON) into out.
+// Returns the number of used records, which may exceed max_count. Never allocates.
+size_t malloc_tracer_callsites(struct malloc_tracer_callsite* out, size_t max_count);
+
+// Copies up to max_count return addresses of an interned stack (TURN_ON_STACK_IDS=ON) into frames, innermost
+// first. Returns the depth of the stack, 0 for an unknown id. Never allocates.
+size_t malloc_tracer_stack(uint32_t stack_id, uintptr_t* frames, size_t max_count);
+
+#define MALLOC_TRACER_LIFETIME_BUCKETS 40
+
+// Copies the block lifetime histogram of a record returned by malloc_tracer_callsites()
+// (TURN_ON_LIFETIMES=ON) into buckets[MALLOC_TRACER_LIFETIME_BUCKETS]. Bucket i counts the frees of blocks
+// that lived for [2^i, 2^(i+1)) timestamp ticks, the last bucket also counts longer lifetimes. Returns 0 for
+// an unknown site.
+int malloc_tracer_lifetimes(const struct malloc_tracer_callsite* site, int64_t* buckets);
+
+// Nanoseconds per timestamp tick, measured since the library was loaded.
+double malloc_tracer_ns_per_tick(void);
+
+#define MALLOC_TRACER_SIZE_BUCKETS 128
+
+// Bucket of a request size in the size histograms (TURN_ON_SIZE_HISTOGRAMS=ON): sizes 0-3 have their own
+// buckets, every larger power of two is split into 4 sub-buckets. Sizes from 7 GiB up share the last bucket.
+static inline unsigned malloc_tracer_size_bucket(size_t size) {
+    if (size < 4) {
+        return (unsigned)size;
+    }
+    unsigned log2 = 63 - __builtin_clzll(size);
+    unsigned bucket = (log2 - 1) * 4 + ((size >> (log2 - 2)) & 3);
+    return bucket < MALLOC_TRACER_SIZE_BUCKETS ? bucket : MALLOC_TRACER_SIZE_BUCKETS - 1;
+}
+
+// Smallest size that falls into a bucket.
+static inline size_t malloc_tracer_size_bucket_floor(unsigned bucket) {
+    return bucket < 4 ? bucket : (size_t)(4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+// Copies the request size histogram of a record returned by malloc_tracer_callsites()
+// (TURN_ON_SIZE_HISTOGRAMS=ON) into buckets[MALLOC_TRACER_SIZE_BUCKETS]. Returns 0 for an unknown site.
+int malloc_tracer_sizes(const struct malloc_tracer_callsite* site, int64_t* buckets);
+
+struct malloc_tracer_realloc_stats {
+    int64_t in_place;     // reallocs that resized the block where it was
+    int64_t moved;        // reallocs that moved the block
+    int64_t copied_bytes; // bytes copied by the moves, min(old size, new size) each
+};
+
+// Copies the realloc statistics of a record returned by malloc_tracer_callsites() (TURN_ON_REALLOC_STATS=ON)
+// into out. They are kept for the site of the realloc() call. Returns 0 for an unknown site.
+int malloc_tracer_reallocs(const struct malloc_tracer_callsite* site,
+                           struct malloc_tracer_realloc_stats* out);
+
+struct malloc_tracer_mapping_stats {
+    int64_t regions;     // live regions mapped by mmap(), mremap() and sbrk() called from the site
+    int64_t bytes;       // their bytes
+    int64_t total_bytes; // bytes the site ever mapped, a moved or resized region adds its growth only
+};
+
+// Copies the mapped memory statistics of a record returned by malloc_tracer_callsites()
+// (TURN_ON_MMAP_STATS=ON) into out. Returns 0 for an unknown site.
+int malloc_tracer_mappings(const struct malloc_tracer_callsite* site,
+                           struct malloc_tracer_mapping_stats* out);
+
+struct malloc_tracer_foreign_free {
+    uintptr_t ret_addr; // of the free() call, 0 for the sites that did not fit in the table
+    int64_t   count;
+};
+
+// Copies up to max_count sites that freed blocks without a valid footer (TURN_ON_FOOTER_CHECK=ON) into out:
+// blocks allocated before the tracer was loaded or by an untraced path, and blocks whose footer was
+// overwritten. Such frees are left out of the statistics. Returns the number of sites, which may exceed
+// max_count. Never allocates.
+size_t malloc_tracer_foreign_frees(struct malloc_tracer_foreign_free* out, size_t max_count);
+
+#define MALLOC_TRACER_SHM_MAGIC "MTSTATS"
+#define MALLOC_TRACER_SHM_VERSION 1
+
+// Layout of the shared-memory segment /dev/shm/malloc_tracer.<pid> (TURN_ON_SHM_STATS=ON). The header is
+// followed by `capacity` callsite records, the first `callsite_count` of them are valid.
+// `seq` is a seqlock: it is odd while the tracer rewrites the segment. A reader loads seq with acquire
+// semantics, copies what it needs, issues an acquire fence and reloads seq; the copy is consistent if both
+// values are equal and even.
+struct malloc_tracer_shm_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t capacity;
+    uint64_t seq;
+    uint64_t update_ns; // CLOCK_REALTIME of the last update
+    int64_t  total_allocs; // TURN_ON_MALLOC_COUNTERS=ON, 0 otherwise
+    int64_t  total_allocated_bytes;
+    uint64_t callsite_count;
+    uint64_t unknown_frees;
+};
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
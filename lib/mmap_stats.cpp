@@ -0,0 +1,257 @@
+#include "mmap_stats.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "address_map.h"
+#include "callsite_table.h"
+#include "malloc_tracer.h"
+#include "report.h"
+
+constexpr std::size_t MAPPED_REGION_BUCKETS = 1 << 12;
+constexpr std::size_t OVERLAP_BATCH = 32; // regions split under one hold of REGIONS_LOCK
+
+enum RegionsState : int { REGIONS_UNMAPPED, REGIONS_MAPPING, REGIONS_READY };
+
+// Region start -> the site and the length in alloc_size. Mapped by the first region, regions recorded
+// meanwhile or when the map is full are counted in UNTRACKED_REGIONS only.
+// AddressMap lets only the owner of an address change its entry, while an unmap may split regions recorded
+// by other threads, so all changes take REGIONS_LOCK. They follow a system call, the lock is not contended.
+// A partial unmap scans the map before it takes the lock and scans again if REGIONS_VERSION shows that a
+// region was replaced meanwhile, which the scan may have missed.
+// fork() holds the lock, so a child never inherits it taken by a thread that does not exist there.
+static AddressMap           MAPPED_REGIONS;
+static std::atomic_int      REGIONS_STATE{REGIONS_UNMAPPED};
+static std::atomic_int64_t  UNTRACKED_REGIONS{0};
+static std::atomic_flag     REGIONS_LOCK = ATOMIC_FLAG_INIT;
+static std::atomic_uint64_t REGIONS_VERSION{0}; // bumped after the new entries of a replaced region are in
+
+static thread_local bool FORKING TRACER_TLS = false; // the thread holds REGIONS_LOCK in fork()
+
+static ExitReport mmap_report; // MALLOC_TRACER_MMAP_REPORT
+
+struct MappingRow {
+    malloc_tracer_callsite      site;
+    malloc_tracer_mapping_stats stats;
+};
+
+// atfork handlers registered before ours run after the prepare handler and may map memory, they already
+// hold the lock through FORKING.
+struct RegionsLock {
+    bool taken;
+
+    RegionsLock() : taken(!FORKING) {
+        while (taken && REGIONS_LOCK.test_and_set(std::memory_order_acquire)) {
+            sched_yield();
+        }
+    }
+    ~RegionsLock() {
+        if (taken) {
+            REGIONS_LOCK.clear(std::memory_order_release);
+        }
+    }
+};
+
+static void lock_regions_for_fork() {
+    while (REGIONS_LOCK.test_and_set(std::memory_order_acquire)) {
+        sched_yield();
+    }
+    FORKING = true;
+}
+
+static void unlock_regions_after_fork() {
+    FORKING = false;
+    REGIONS_LOCK.clear(std::memory_order_release);
+}
+
+static bool regions_ready() {
+    int state = REGIONS_STATE.load(std::memory_order_acquire);
+    if (state == REGIONS_READY) {
+        return true;
+    }
+    if (state != REGIONS_UNMAPPED ||
+        !REGIONS_STATE.compare_exchange_strong(state, REGIONS_MAPPING, std::memory_order_acq_rel)) {
+        return false;
+    }
+    if (!MAPPED_REGIONS.init(MAPPED_REGION_BUCKETS)) {
+        return false; // stays REGIONS_MAPPING, nothing is tracked
+    }
+    REGIONS_STATE.store(REGIONS_READY, std::memory_order_release);
+    return true;
+}
+
+static bool insert_region(std::uintptr_t start, std::size_t length, std::uintptr_t site) {
+    if (!regions_ready() || !MAPPED_REGIONS.insert(start, BlockInfo{site, length})) {
+        UNTRACKED_REGIONS.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+// Forgets the part of a region in [start, end), the head and the tail stay as regions of their own. The
+// caller holds REGIONS_LOCK.
+static void split_region(std::uintptr_t regionStart, const BlockInfo& info, std::uintptr_t start,
+                         std::uintptr_t end) {
+    std::uintptr_t regionEnd = regionStart + info.alloc_size;
+    if (regionEnd <= start || regionStart >= end) {
+        return;
+    }
+    std::uintptr_t unmapped = std::min(end, regionEnd) - std::max(start, regionStart);
+    std::int64_t   regions = -1;
+    std::int64_t   bytes = -static_cast<std::int64_t>(unmapped);
+    BlockInfo      region;
+    MAPPED_REGIONS.remove(regionStart, &region);
+    auto keep = [&](std::uintptr_t keptStart, std::size_t keptLength) {
+        if (insert_region(keptStart, keptLength, info.site)) {
+            ++regions;
+        } else {
+            bytes -= static_cast<std::int64_t>(keptLength);
+        }
+    };
+    if (regionStart < start) {
+        keep(regionStart, start - regionStart);
+    }
+    if (regionEnd > end) {
+        keep(end, regionEnd - end);
+    }
+    REGIONS_VERSION.fetch_add(1, std::memory_order_release);
+    CALLSITE_TABLE.get(info.site)->on_map(regions, bytes);
+}
+
+static void forget_regions(std::uintptr_t start, std::size_t length) {
+    if (length == 0 || REGIONS_STATE.load(std::memory_order_acquire) != REGIONS_READY) {
+        return;
+    }
+    {
+        RegionsLock lock;
+        BlockInfo   region;
+        if (MAPPED_REGIONS.find(start, &region) && region.alloc_size == length) {
+            MAPPED_REGIONS.remove(start, &region);
+            CALLSITE_TABLE.get(region.site)->on_map(-1, -static_cast<std::int64_t>(length));
+            return;
+        }
+    }
+    // the regions found by a scan are looked up again under the lock, a full batch means more may be left
+    std::uintptr_t end = start + length;
+    std::uintptr_t overlapping[OVERLAP_BATCH];
+    std::size_t    count;
+    do {
+        std::uint64_t version = REGIONS_VERSION.load(std::memory_order_acquire);
+        count = 0;
+        MAPPED_REGIONS.for_each([&](std::uintptr_t regionStart, const BlockInfo& info) {
+            if (count < OVERLAP_BATCH && regionStart < end && regionStart + info.alloc_size > start) {
+                overlapping[count++] = regionStart;
+            }
+        });
+        RegionsLock lock;
+        if (REGIONS_VERSION.load(std::memory_order_acquire) != version) {
+            count = OVERLAP_BATCH;
+            continue;
+        }
+        for (std::size_t i = 0; i < count; ++i) {
+            BlockInfo region;
+            if (MAPPED_REGIONS.find(overlapping[i], &region)) {
+                split_region(overlapping[i], region, start, end);
+            }
+        }
+    } while (count == OVERLAP_BATCH);
+}
+
+static void record_region(std::uintptr_t start, std::size_t length, std::uintptr_t site) {
+    if (length != 0 && insert_region(start, length, site)) {
+        CALLSITE_TABLE.get(site)->on_map(1, length);
+    }
+}
+
+void record_mapping(std::uintptr_t start, std::size_t length, std::uintptr_t site) {
+    RegionsLock lock;
+    record_region(start, length, site);
+}
+
+void forget_mappings(std::uintptr_t start, std::size_t length) {
+    forget_regions(start, length);
+}
+
+void record_remapping(std::uintptr_t oldStart, std::size_t oldLength, std::uintptr_t newStart,
+                      std::size_t newLength, std::uintptr_t site, bool keepOld) {
+    if (!keepOld && REGIONS_STATE.load(std::memory_order_acquire) == REGIONS_READY) {
+        RegionsLock lock;
+        BlockInfo   region;
+        if (MAPPED_REGIONS.find(oldStart, &region)) {
+            site = region.site;
+            if (region.alloc_size == oldLength) { // the whole region moved or resized, only the growth is new
+                MAPPED_REGIONS.remove(oldStart, &region);
+                CallsiteStats* stats = CALLSITE_TABLE.get(site);
+                if (insert_region(newStart, newLength, site)) {
+                    stats->on_map(0, static_cast<std::int64_t>(newLength) -
+                                         static_cast<std::int64_t>(oldLength));
+                } else {
+                    stats->on_map(-1, -static_cast<std::int64_t>(oldLength));
+                }
+                REGIONS_VERSION.fetch_add(1, std::memory_order_release);
+                return;
+            }
+        }
+    }
+    if (!keepOld) {
+        forget_regions(oldStart, oldLength);
+    }
+    record_mapping(newStart, newLength, site);
+}
+
+extern "C" int malloc_tracer_mappings(const malloc_tracer_callsite* site, malloc_tracer_mapping_stats* out) {
+    const CallsiteStats* stats = CALLSITE_TABLE.find(callsite_key(*site));
+    if (!stats) {
+        return 0;
+    }
+    out->regions = stats->mapped_regions.load(std::memory_order_relaxed);
+    out->bytes = stats->mapped_bytes.load(std::memory_order_relaxed);
+    out->total_bytes = stats->total_mapped_bytes.load(std::memory_order_relaxed);
+    return 1;
+}
+
+// Sites that mapped memory, most live mapped bytes first, with the live malloc bytes of the same sites.
+static void write_report(int fd) {
+    write_callsite_rows<MappingRow>(
+        fd,
+        [](MappingRow& row) {
+            return malloc_tracer_mappings(&row.site, &row.stats) && row.stats.total_bytes > 0;
+        },
+        [](const MappingRow& a, const MappingRow& b) {
+            return a.stats.bytes != b.stats.bytes ? a.stats.bytes > b.stats.bytes
+                                                  : a.stats.total_bytes > b.stats.total_bytes;
+        },
+        [](int fd, const MappingRow* rows, std::size_t count) {
+            std::int64_t regions = 0;
+            std::int64_t bytes = 0;
+            for (std::size_t i = 0; i < count; ++i) {
+                regions += rows[i].stats.regions;
+                bytes += rows[i].stats.bytes;
+            }
+            dprintf(fd, "# %ld bytes in %ld mapped regions of %zu sites, %ld regions untracked\n", bytes,
+                    regions, count, UNTRACKED_REGIONS.load(std::memory_order_relaxed));
+            dprintf(fd, "%8s %14s %14s %14s  %s\n", "regions", "mapped", "total mapped", "malloc live",
+                    "site");
+        },
+        [](int fd, const MappingRow& row) {
+            dprintf(fd, "%8ld %14ld %14ld %14ld", row.stats.regions, row.stats.bytes, row.stats.total_bytes,
+                    row.site.live_bytes);
+        });
+}
+
+__attribute__((constructor)) static void start_mmap_stats() {
+    if (pthread_atfork(lock_regions_for_fork, unlock_regions_after_fork, unlock_regions_after_fork) != 0) {
+        fprintf(stderr, "Error: cannot register the fork handlers of the mmap stats\n");
+        exit(1);
+    }
+    mmap_report.start("MALLOC_TRACER_MMAP_REPORT");
+}
+
+__attribute__((destructor)) static void write_mmap_report() {
+    mmap_report.finish(write_report);
+}
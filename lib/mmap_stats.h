@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Regions mapped by the mmap(), mremap() and sbrk() hooks (TURN_ON_MMAP_STATS), attributed to the site of the
+// caller in CALLSITE_TABLE next to its malloc statistics. Lengths are rounded up to whole pages by the hooks,
+// the program break is tracked to the byte.
+
+// Records a new region [start, start + length).
+void record_mapping(std::uintptr_t start, std::size_t length, std::uintptr_t site);
+
+// Forgets whatever part of the recorded regions lies in [start, start + length). Unmapping a whole region
+// costs one lookup, a part of one or several regions read the whole region table.
+void forget_mappings(std::uintptr_t start, std::size_t length);
+
+// A successful mremap(). The region keeps the site of its old place, site is used when that is unknown.
+// keepOld is set for MREMAP_DONTUNMAP.
+void record_remapping(std::uintptr_t oldStart, std::size_t oldLength, std::uintptr_t newStart,
+                      std::size_t newLength, std::uintptr_t site, bool keepOld);
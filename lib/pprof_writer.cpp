@@ -0,0 +1,323 @@
+#include "pprof_writer.h"
+
+#include <elf.h>
+#include <errno.h>
+#include <link.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+
+#include "stack_trace.h"
+#include "tracer_memory.h"
+
+constexpr int         MAX_MAPPINGS = 256;
+constexpr std::size_t BUILD_ID_SIZE = 64;
+constexpr std::size_t OUTPUT_BUFFER_SIZE = 1 << 16;
+
+// Field numbers of profile.proto
+enum ProfileField : std::uint32_t {
+    PROFILE_SAMPLE_TYPE = 1,
+    PROFILE_SAMPLE = 2,
+    PROFILE_MAPPING = 3,
+    PROFILE_LOCATION = 4,
+    PROFILE_STRING_TABLE = 6,
+    PROFILE_TIME_NANOS = 9,
+    PROFILE_DEFAULT_SAMPLE_TYPE = 14,
+    VALUE_TYPE_TYPE = 1,
+    VALUE_TYPE_UNIT = 2,
+    SAMPLE_LOCATION_ID = 1,
+    SAMPLE_VALUE = 2,
+    MAPPING_ID = 1,
+    MAPPING_MEMORY_START = 2,
+    MAPPING_MEMORY_LIMIT = 3,
+    MAPPING_FILE_OFFSET = 4,
+    MAPPING_FILENAME = 5,
+    MAPPING_BUILD_ID = 6,
+    LOCATION_ID = 1,
+    LOCATION_MAPPING_ID = 2,
+    LOCATION_ADDRESS = 3,
+};
+
+// String table: the fixed strings, then the file name and the build id of every mapping.
+static const char* const FIXED_STRINGS[] = {"",      "alloc_objects", "count",      "alloc_space",
+                                            "bytes", "inuse_objects", "inuse_space"};
+enum StringIndex : std::int64_t {
+    STR_ALLOC_OBJECTS = 1,
+    STR_COUNT = 2,
+    STR_ALLOC_SPACE = 3,
+    STR_BYTES = 4,
+    STR_INUSE_OBJECTS = 5,
+    STR_INUSE_SPACE = 6,
+    STR_FIRST_MAPPING = 7,
+};
+
+struct Mapping {
+    std::uintptr_t start;
+    std::uintptr_t limit;
+    std::uintptr_t file_offset;
+    const char*    filename;
+    char           build_id[BUILD_ID_SIZE * 2 + 1];
+};
+
+struct LocationSlot {
+    std::uintptr_t address; // 0 - free
+    std::uint64_t  id;
+};
+
+static struct PprofState {
+    Mapping       mappings[MAX_MAPPINGS]{};
+    int           mapping_count = 0;
+    char          exe_path[PATH_MAX] = {};
+    LocationSlot* locations = nullptr;
+    std::size_t   location_capacity = 0; // a power of two
+    std::uint64_t location_count = 0;
+    int           fd = -1;
+    bool          failed = false;
+    std::size_t   used = 0;
+    std::uint8_t  buffer[OUTPUT_BUFFER_SIZE] = {};
+} pprof;
+
+// A protobuf message encoded into a fixed buffer, big enough for every message but the top-level one.
+struct Message {
+    std::uint8_t data[1024];
+    std::size_t  size = 0;
+
+    void varint(std::uint64_t value) {
+        while (value >= 0x80 && size < sizeof(data)) {
+            data[size++] = static_cast<std::uint8_t>(value | 0x80);
+            value >>= 7;
+        }
+        if (size < sizeof(data)) {
+            data[size++] = static_cast<std::uint8_t>(value);
+        }
+    }
+
+    void field(std::uint32_t number, std::uint64_t value) {
+        varint(number << 3); // wire type 0, varint
+        varint(value);
+    }
+
+    void bytes(std::uint32_t number, const void* value, std::size_t len) {
+        varint(number << 3 | 2); // wire type 2, length-delimited
+        varint(len);
+        len = std::min(len, sizeof(data) - size);
+        memcpy(data + size, value, len);
+        size += len;
+    }
+};
+
+static void flush_output() {
+    for (std::size_t done = 0; done < pprof.used && !pprof.failed;) {
+        ssize_t written = write(pprof.fd, pprof.buffer + done, pprof.used - done);
+        if (written < 0 && errno != EINTR) {
+            pprof.failed = true;
+        }
+        done += written > 0 ? written : 0;
+    }
+    pprof.used = 0;
+}
+
+static void output(const void* data, std::size_t size) {
+    if (OUTPUT_BUFFER_SIZE - pprof.used < size) {
+        flush_output();
+    }
+    memcpy(pprof.buffer + pprof.used, data, size);
+    pprof.used += size;
+}
+
+// Writes a field of the top-level Profile message.
+static void output_field(std::uint32_t number, const Message& message) {
+    Message header;
+    header.varint(number << 3 | 2);
+    header.varint(message.size);
+    output(header.data, header.size);
+    output(message.data, message.size);
+}
+
+static void output_value_field(std::uint32_t number, std::uint64_t value) {
+    Message message;
+    message.field(number, value);
+    output(message.data, message.size);
+}
+
+static void output_string(const char* value) {
+    Message header;
+    std::size_t len = strlen(value);
+    header.varint(PROFILE_STRING_TABLE << 3 | 2);
+    header.varint(len);
+    output(header.data, header.size);
+    for (std::size_t done = 0; done < len; done += OUTPUT_BUFFER_SIZE / 2) {
+        output(value + done, std::min<std::size_t>(len - done, OUTPUT_BUFFER_SIZE / 2));
+    }
+}
+
+static void read_build_id(const dl_phdr_info* info, const ElfW(Phdr) & phdr, char* out) {
+    const auto* note = reinterpret_cast<const char*>(info->dlpi_addr + phdr.p_vaddr);
+    const char* end = note + phdr.p_memsz;
+    while (note + sizeof(ElfW(Nhdr)) <= end) {
+        const auto* header = reinterpret_cast<const ElfW(Nhdr)*>(note);
+        const char* name = note + sizeof(ElfW(Nhdr));
+        const char* desc = name + ((header->n_namesz + 3) & ~3u);
+        if (header->n_type == NT_GNU_BUILD_ID && header->n_namesz == 4 && memcmp(name, "GNU", 4) == 0) {
+            std::size_t len = std::min<std::size_t>(header->n_descsz, BUILD_ID_SIZE);
+            for (std::size_t i = 0; i < len; ++i) {
+                static const char digits[] = "0123456789abcdef";
+                out[2 * i] = digits[static_cast<std::uint8_t>(desc[i]) >> 4];
+                out[2 * i + 1] = digits[static_cast<std::uint8_t>(desc[i]) & 0xF];
+            }
+            out[2 * len] = '\0';
+            return;
+        }
+        note = desc + ((header->n_descsz + 3) & ~3u);
+    }
+}
+
+static int add_mappings(dl_phdr_info* info, size_t, void*) {
+    const char* filename = info->dlpi_name && info->dlpi_name[0] ? info->dlpi_name : pprof.exe_path;
+    char        buildId[BUILD_ID_SIZE * 2 + 1] = {};
+    for (int i = 0; i < info->dlpi_phnum; ++i) {
+        if (info->dlpi_phdr[i].p_type == PT_NOTE) {
+            read_build_id(info, info->dlpi_phdr[i], buildId);
+        }
+    }
+    for (int i = 0; i < info->dlpi_phnum && pprof.mapping_count < MAX_MAPPINGS; ++i) {
+        const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+        if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_X)) {
+            Mapping& mapping = pprof.mappings[pprof.mapping_count++];
+            mapping.start = info->dlpi_addr + phdr.p_vaddr;
+            mapping.limit = mapping.start + phdr.p_memsz;
+            mapping.file_offset = phdr.p_offset;
+            mapping.filename = filename;
+            memcpy(mapping.build_id, buildId, sizeof(buildId));
+        }
+    }
+    return 0;
+}
+
+static std::uint64_t mapping_id(std::uintptr_t address) {
+    for (int i = 0; i < pprof.mapping_count; ++i) {
+        if (address >= pprof.mappings[i].start && address < pprof.mappings[i].limit) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+// Location id of an address, a new location for a new address.
+static std::uint64_t location_id(std::uintptr_t address) {
+    std::size_t mask = pprof.location_capacity - 1;
+    for (std::size_t idx = (address * 0x9E3779B97F4A7C15ull) >> 20 & mask;; idx = (idx + 1) & mask) {
+        LocationSlot& slot = pprof.locations[idx];
+        if (slot.address == address) {
+            return slot.id;
+        }
+        if (slot.address == 0) {
+            slot = {address, ++pprof.location_count};
+            return slot.id;
+        }
+    }
+}
+
+static void output_sample(const malloc_tracer_callsite& site) {
+    std::uintptr_t frames[STACK_TRACE_MAX_DEPTH];
+    std::size_t    depth = 0;
+#ifdef TURN_ON_STACK_IDS
+    depth = std::min<std::size_t>(malloc_tracer_stack(site.stack_id, frames, STACK_TRACE_MAX_DEPTH),
+                                  STACK_TRACE_MAX_DEPTH);
+#endif
+    if (depth == 0) {
+        frames[depth++] = site.ret_addr;
+    }
+    Message locations;
+    for (std::size_t i = 0; i < depth; ++i) {
+        locations.varint(location_id(frames[i]));
+    }
+    Message values;
+    for (std::int64_t value : {site.total_count, site.total_bytes, site.live_count, site.live_bytes}) {
+        values.varint(static_cast<std::uint64_t>(value));
+    }
+    Message sample;
+    sample.bytes(SAMPLE_LOCATION_ID, locations.data, locations.size); // packed repeated fields
+    sample.bytes(SAMPLE_VALUE, values.data, values.size);
+    output_field(PROFILE_SAMPLE, sample);
+}
+
+static void output_value_type(std::int64_t type, std::int64_t unit) {
+    Message valueType;
+    valueType.field(VALUE_TYPE_TYPE, type);
+    valueType.field(VALUE_TYPE_UNIT, unit);
+    output_field(PROFILE_SAMPLE_TYPE, valueType);
+}
+
+bool write_pprof_profile(int fd, const malloc_tracer_callsite* sites, std::size_t count) {
+    pprof.fd = fd;
+    pprof.failed = false;
+    pprof.used = 0;
+    pprof.mapping_count = 0;
+    ssize_t exeLen = readlink("/proc/self/exe", pprof.exe_path, sizeof(pprof.exe_path) - 1);
+    pprof.exe_path[exeLen > 0 ? exeLen : 0] = '\0';
+    dl_iterate_phdr(add_mappings, NULL);
+
+    // Sized for the worst case of distinct frames at half load, freed at the end of the dump.
+    std::size_t frames = std::max<std::size_t>(count, 1) * STACK_TRACE_MAX_DEPTH * 2;
+    pprof.location_capacity = std::size_t(1) << (64 - __builtin_clzll(frames - 1));
+    pprof.location_count = 0;
+    pprof.locations =
+        static_cast<LocationSlot*>(map_tracer_memory(pprof.location_capacity * sizeof(LocationSlot)));
+    if (!pprof.locations) {
+        return false;
+    }
+
+    output_value_type(STR_ALLOC_OBJECTS, STR_COUNT);
+    output_value_type(STR_ALLOC_SPACE, STR_BYTES);
+    output_value_type(STR_INUSE_OBJECTS, STR_COUNT);
+    output_value_type(STR_INUSE_SPACE, STR_BYTES);
+    for (std::size_t i = 0; i < count; ++i) {
+        if (sites[i].ret_addr != 0) { // sites lost to a full table have no address
+            output_sample(sites[i]);
+        }
+    }
+    for (std::size_t i = 0; i < pprof.location_capacity; ++i) {
+        const LocationSlot& slot = pprof.locations[i];
+        if (slot.address == 0) {
+            continue;
+        }
+        Message location;
+        location.field(LOCATION_ID, slot.id);
+        location.field(LOCATION_MAPPING_ID, mapping_id(slot.address));
+        location.field(LOCATION_ADDRESS, slot.address - 1); // return address -> the call instruction
+        output_field(PROFILE_LOCATION, location);
+    }
+    for (int i = 0; i < pprof.mapping_count; ++i) {
+        const Mapping& mapping = pprof.mappings[i];
+        Message        message;
+        message.field(MAPPING_ID, i + 1);
+        message.field(MAPPING_MEMORY_START, mapping.start);
+        message.field(MAPPING_MEMORY_LIMIT, mapping.limit);
+        message.field(MAPPING_FILE_OFFSET, mapping.file_offset);
+        message.field(MAPPING_FILENAME, STR_FIRST_MAPPING + 2 * i);
+        message.field(MAPPING_BUILD_ID, STR_FIRST_MAPPING + 2 * i + 1);
+        output_field(PROFILE_MAPPING, message);
+    }
+    for (const char* value : FIXED_STRINGS) {
+        output_string(value);
+    }
+    for (int i = 0; i < pprof.mapping_count; ++i) {
+        output_string(pprof.mappings[i].filename);
+        output_string(pprof.mappings[i].build_id);
+    }
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    output_value_field(PROFILE_TIME_NANOS, now.tv_sec * 1000000000ull + now.tv_nsec);
+    output_value_field(PROFILE_DEFAULT_SAMPLE_TYPE, STR_INUSE_SPACE);
+    flush_output();
+
+    tracer_munmap(pprof.locations, pprof.location_capacity * sizeof(LocationSlot));
+    pprof.locations = nullptr;
+    return !pprof.failed;
+}
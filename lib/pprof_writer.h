@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstddef>
+
+#include "malloc_tracer.h"
+
+// Writes an uncompressed pprof profile (profile.proto) of the sites to fd with the sample types
+// alloc_objects, alloc_space, inuse_objects and inuse_space. Locations are the site return addresses, or
+// the whole stacks with TURN_ON_STACK_IDS. Mappings and build ids come from dl_iterate_phdr(), so pprof
+// symbolizes the profile with the binaries. Never calls the hooked malloc. Returns false on a write error.
+bool write_pprof_profile(int fd, const malloc_tracer_callsite* sites, std::size_t count);
@@ -0,0 +1,55 @@
+#include <stdio.h>
+
+#include "callsite_table.h"
+#include "malloc_tracer.h"
+#include "report.h"
+
+static ExitReport realloc_report; // MALLOC_TRACER_REALLOC_REPORT
+
+struct ReallocRow {
+    malloc_tracer_callsite      site;
+    malloc_tracer_realloc_stats stats;
+};
+
+extern "C" int malloc_tracer_reallocs(const malloc_tracer_callsite* site, malloc_tracer_realloc_stats* out) {
+    const CallsiteStats* stats = CALLSITE_TABLE.find(callsite_key(*site));
+    if (!stats) {
+        return 0;
+    }
+    out->in_place = stats->reallocs_in_place.load(std::memory_order_relaxed);
+    out->moved = stats->reallocs_moved.load(std::memory_order_relaxed);
+    out->copied_bytes = stats->realloc_copied_bytes.load(std::memory_order_relaxed);
+    return 1;
+}
+
+// Sites with reallocs, most copied bytes first: growth that should reserve() up front.
+static void write_report(int fd) {
+    write_callsite_rows<ReallocRow>(
+        fd,
+        [](ReallocRow& row) {
+            return malloc_tracer_reallocs(&row.site, &row.stats) && row.stats.in_place + row.stats.moved > 0;
+        },
+        [](const ReallocRow& a, const ReallocRow& b) {
+            return a.stats.copied_bytes != b.stats.copied_bytes ? a.stats.copied_bytes > b.stats.copied_bytes
+                                                                : a.stats.moved > b.stats.moved;
+        },
+        [](int fd, const ReallocRow*, std::size_t count) {
+            dprintf(fd, "# reallocs of %zu sites\n", count);
+            dprintf(fd, "%10s %10s %7s %14s %10s  %s\n", "reallocs", "moved", "moved%", "copied", "per move",
+                    "site");
+        },
+        [](int fd, const ReallocRow& row) {
+            std::int64_t reallocs = row.stats.in_place + row.stats.moved;
+            dprintf(fd, "%10ld %10ld %6.1f%% %14ld %10ld", reallocs, row.stats.moved,
+                    100.0 * row.stats.moved / reallocs, row.stats.copied_bytes,
+                    row.stats.moved ? row.stats.copied_bytes / row.stats.moved : 0);
+        });
+}
+
+__attribute__((constructor)) static void start_realloc_stats() {
+    realloc_report.start("MALLOC_TRACER_REALLOC_REPORT");
+}
+
+__attribute__((destructor)) static void write_realloc_report() {
+    realloc_report.finish(write_report);
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#include "callsite_table.h"
+#include "malloc_tracer.h"
+#include "tracer_memory.h"
+
+// Helpers of the text reports written at exit. They never call the hooked malloc.
+
+constexpr std::size_t REPORT_CALLSITES = CALLSITE_TABLE_SIZE + 1; // with the overflow record
+
+// Opens <prefix>.<pid> for writing: children inherit the environment. Returns -1 on failure.
+inline int open_report(const char* prefix, pid_t pid) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s.%d", prefix, pid);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "malloc_tracer: cannot write report %s: %s\n", path, strerror(errno));
+    }
+    return fd;
+}
+
+inline void format_ns(char* out, std::size_t size, double ns) {
+    if (ns < 1e3) {
+        snprintf(out, size, "%.0fns", ns);
+    } else if (ns < 1e6) {
+        snprintf(out, size, "%.1fus", ns / 1e3);
+    } else if (ns < 1e9) {
+        snprintf(out, size, "%.1fms", ns / 1e6);
+    } else {
+        snprintf(out, size, "%.1fs", ns / 1e9);
+    }
+}
+
+// Prints " 0x<addr> symbol+offset (object+offset)".
+inline void print_site(int fd, std::uintptr_t addr) {
+    dprintf(fd, "  %#lx", addr);
+    Dl_info info;
+    if (addr != 0 && dladdr(reinterpret_cast<void*>(addr), &info)) {
+        const char* object = info.dli_fname ? strrchr(info.dli_fname, '/') : nullptr;
+        object = object ? object + 1 : info.dli_fname;
+        if (info.dli_sname) {
+            dprintf(fd, " %s+%#lx", info.dli_sname, addr - reinterpret_cast<std::uintptr_t>(info.dli_saddr));
+        }
+        dprintf(fd, " (%s+%#lx)", object ? object : "?",
+                addr - reinterpret_cast<std::uintptr_t>(info.dli_fbase));
+    }
+    dprintf(fd, "\n");
+}
+
+// A report named by an environment variable, started by a constructor and written by a destructor.
+struct ExitReport {
+    const char* path = nullptr;
+    pid_t       pid = 0; // the report is written by the process that read the variable only
+
+    void start(const char* variable) {
+        path = getenv(variable);
+        pid = getpid();
+    }
+
+    // Calls write(fd) on the open report.
+    template <typename Write>
+    void finish(Write write) const {
+        if (!path || getpid() != pid) {
+            return;
+        }
+        int fd = open_report(path, pid);
+        if (fd >= 0) {
+            write(fd);
+            close(fd);
+        }
+    }
+};
+
+// Writes a table of the sites of malloc_tracer_callsites(). Row has a malloc_tracer_callsite `site`,
+// fill(row) completes a row with the site set and returns false to skip it. The rows are sorted by less, then
+// header(fd, rows, count) and for every row print(fd, row) with the site after it are called.
+template <typename Row, typename Fill, typename Less, typename Header, typename Print>
+void write_callsite_rows(int fd, Fill fill, Less less, Header header, Print print) {
+    auto* sites = static_cast<malloc_tracer_callsite*>(
+        map_tracer_memory(REPORT_CALLSITES * sizeof(malloc_tracer_callsite)));
+    auto* rows = static_cast<Row*>(map_tracer_memory(REPORT_CALLSITES * sizeof(Row)));
+    if (sites && rows) {
+        std::size_t count = std::min(malloc_tracer_callsites(sites, REPORT_CALLSITES), REPORT_CALLSITES);
+        std::size_t rowCount = 0;
+        for (std::size_t i = 0; i < count; ++i) {
+            Row& row = rows[rowCount];
+            row.site = sites[i];
+            rowCount += fill(row);
+        }
+        std::sort(rows, rows + rowCount, less);
+        header(fd, static_cast<const Row*>(rows), rowCount);
+        for (std::size_t i = 0; i < rowCount; ++i) {
+            print(fd, static_cast<const Row&>(rows[i]));
+            print_site(fd, rows[i].site.ret_addr);
+        }
+    }
+    if (sites) {
+        tracer_munmap(sites, REPORT_CALLSITES * sizeof(malloc_tracer_callsite));
+    }
+    if (rows) {
+        tracer_munmap(rows, REPORT_CALLSITES * sizeof(Row));
+    }
+}
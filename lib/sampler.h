@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include "sharded_counter.h"
+
+// Mean number of bytes between two sampled allocations, 0 - every allocation is traced.
+// Set once by __lib_hook_init() from the MALLOC_TRACER_SAMPLE_RATE environment variable.
+extern std::int64_t SAMPLE_RATE;
+
+inline thread_local std::int64_t  BYTES_UNTIL_SAMPLE TRACER_TLS = 0;
+inline thread_local std::uint64_t SAMPLER_RNG_STATE TRACER_TLS = 0;
+inline std::atomic_uint64_t       SAMPLER_SEED = 0x853C49E6748FEA9Bull;
+
+struct SampleWeight {
+    std::int64_t count;
+    std::int64_t bytes;
+};
+
+inline std::uint64_t sampler_next_random() {
+    // xorshift64*
+    std::uint64_t x = SAMPLER_RNG_STATE;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    SAMPLER_RNG_STATE = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+// Distance to the next sample point of a Poisson process over allocated bytes with mean SAMPLE_RATE.
+inline std::int64_t next_sample_interval() {
+    double u = (sampler_next_random() >> 11) * 0x1.0p-53; // [0, 1)
+    return static_cast<std::int64_t>(-std::log1p(-u) * SAMPLE_RATE) + 1;
+}
+
+__attribute__((noinline)) inline bool should_sample_slow(std::size_t size) {
+    if (SAMPLER_RNG_STATE == 0) { // the first allocation of the thread
+        SAMPLER_RNG_STATE = (SAMPLER_SEED.fetch_add(0x9E3779B97F4A7C15ull, std::memory_order_relaxed) ^
+                             reinterpret_cast<std::uintptr_t>(&SAMPLER_RNG_STATE)) |
+                            1;
+        BYTES_UNTIL_SAMPLE = next_sample_interval() - static_cast<std::int64_t>(size);
+        if (BYTES_UNTIL_SAMPLE > 0) {
+            return false;
+        }
+    }
+    BYTES_UNTIL_SAMPLE = next_sample_interval();
+    return true;
+}
+
+// True if the allocation covers a sample point. The fast path is a thread-local decrement.
+inline bool should_sample(std::size_t size) {
+    BYTES_UNTIL_SAMPLE -= static_cast<std::int64_t>(size);
+    if (__builtin_expect(BYTES_UNTIL_SAMPLE > 0, 1)) {
+        return false;
+    }
+    return should_sample_slow(size);
+}
+
+// Unbiased estimate of the allocations a traced block stands for. An allocation of `size` bytes is sampled
+// with probability p = 1 - exp(-size / SAMPLE_RATE), so it is counted as 1/p allocations of size/p bytes.
+// The fractional part of 1/p is rounded stochastically by a hash of the block address, which makes the
+// weight reproducible on free().
+inline SampleWeight sample_weight(std::uintptr_t ptr, std::size_t size) {
+    if (SAMPLE_RATE == 0) {
+        return {1, static_cast<std::int64_t>(size)};
+    }
+    double p = -std::expm1(-static_cast<double>(size ? size : 1) / SAMPLE_RATE);
+    double count = 1.0 / p;
+    double whole = std::floor(count);
+    double r = ((((ptr >> 4) * 0x9E3779B97F4A7C15ull) >> 11) * 0x1.0p-53);
+    return {static_cast<std::int64_t>(whole) + (r < count - whole), std::llround(size / p)};
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+constexpr std::size_t CACHE_LINE_SIZE = 64;
+constexpr std::size_t COUNTER_SHARDS = 128;
+
+#define TRACER_TLS __attribute__((tls_model("initial-exec")))
+
+// Shard index of the current thread plus one, 0 until the first counter update.
+// Threads are spread round-robin, so shards are shared only with more than COUNTER_SHARDS threads.
+inline thread_local std::uint32_t THREAD_SHARD TRACER_TLS = 0;
+inline std::atomic_uint32_t       NEXT_THREAD_SHARD = 0;
+
+inline std::size_t thread_shard() {
+    if (__builtin_expect(THREAD_SHARD == 0, 0)) {
+        THREAD_SHARD = NEXT_THREAD_SHARD.fetch_add(1, std::memory_order_relaxed) % COUNTER_SHARDS + 1;
+    }
+    return THREAD_SHARD - 1;
+}
+
+struct alignas(CACHE_LINE_SIZE) CounterShard {
+    std::atomic_int64_t value{0};
+};
+
+// Counter split into cache-line-padded per-thread shards: updates never bounce a line between
+// cores, the value is the sum of all shards. A shard alone can go negative when memory is freed by
+// another thread than the one that allocated it.
+// gdb_plugin/gdb_malloc_tracer registers a pretty printer that sums the shards from a core.
+struct ShardedCounter {
+    CounterShard shards[COUNTER_SHARDS];
+
+    void add(std::int64_t v) {
+        shards[thread_shard()].value.fetch_add(v, std::memory_order_relaxed);
+    }
+
+    void sub(std::int64_t v) {
+        shards[thread_shard()].value.fetch_sub(v, std::memory_order_relaxed);
+    }
+
+    std::int64_t load() const {
+        std::int64_t sum = 0;
+        for (const auto& shard : shards) {
+            sum += shard.value.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+};
@@ -0,0 +1,113 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "callsite_table.h"
+#include "malloc_tracer.h"
+#include "sharded_counter.h"
+#include "tracer_memory.h"
+#include "tracer_thread.h"
+
+
+#ifdef TURN_ON_CALLSITE_STATS
+constexpr std::size_t SHM_CALLSITES = CALLSITE_TABLE_SIZE + 1; // with the overflow record
+#else
+constexpr std::size_t SHM_CALLSITES = 0;
+#endif
+
+static struct ShmStats {
+    malloc_tracer_shm_header* header = nullptr;
+    std::size_t               size = 0;
+    char                      name[64] = {};
+    long                      interval_ms = 0;
+    pthread_t                 thread{};
+    std::atomic_bool          stop{false};
+    bool                      owner = false; // false in forked children
+} shm_stats;
+
+static void publish_stats() {
+    malloc_tracer_shm_header* header = shm_stats.header;
+    std::uint64_t             seq = header->seq;
+    __atomic_store_n(&header->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    header->update_ns = now.tv_sec * 1000000000ull + now.tv_nsec;
+#ifdef TURN_ON_MALLOC_COUNTERS
+    header->total_allocs = malloc_tracer_total_allocs();
+    header->total_allocated_bytes = malloc_tracer_total_allocated_bytes();
+#endif
+#ifdef TURN_ON_CALLSITE_STATS
+    auto*       callsites = reinterpret_cast<malloc_tracer_callsite*>(header + 1);
+    std::size_t count = malloc_tracer_callsites(callsites, SHM_CALLSITES);
+    header->callsite_count = count < SHM_CALLSITES ? count : SHM_CALLSITES;
+    header->unknown_frees = CALLSITE_TABLE.unknown_frees.load(std::memory_order_relaxed);
+#endif
+
+    __atomic_store_n(&header->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void* publisher_thread(void*) {
+    TRACER_THREAD = true;
+    while (!shm_stats.stop.load(std::memory_order_acquire)) {
+        publish_stats();
+        timespec interval = {shm_stats.interval_ms / 1000, shm_stats.interval_ms % 1000 * 1000000};
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+// The publisher thread does not exist in a forked child, the segment stays the parent's.
+static void stop_in_child() {
+    shm_stats.owner = false;
+}
+
+__attribute__((constructor)) static void start_shm_stats() {
+    const char* interval = getenv("MALLOC_TRACER_SHM");
+    if (!interval) {
+        return;
+    }
+    shm_stats.interval_ms = strtol(interval, NULL, 10);
+    if (shm_stats.interval_ms <= 0) {
+        fprintf(stderr, "Error: bad MALLOC_TRACER_SHM=%s, expected the refresh interval in ms\n", interval);
+        exit(1);
+    }
+    snprintf(shm_stats.name, sizeof(shm_stats.name), "/malloc_tracer.%d", getpid());
+    shm_stats.size = sizeof(malloc_tracer_shm_header) + SHM_CALLSITES * sizeof(malloc_tracer_callsite);
+    int fd = shm_open(shm_stats.name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, shm_stats.size) != 0) {
+        fprintf(stderr, "Error: cannot create shared memory %s: %s\n", shm_stats.name, strerror(errno));
+        exit(1);
+    }
+    void* memory = tracer_mmap(NULL, shm_stats.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        fprintf(stderr, "Error: cannot map shared memory %s: %s\n", shm_stats.name, strerror(errno));
+        exit(1);
+    }
+    shm_stats.header = static_cast<malloc_tracer_shm_header*>(memory);
+    memcpy(shm_stats.header->magic, MALLOC_TRACER_SHM_MAGIC, sizeof(MALLOC_TRACER_SHM_MAGIC));
+    shm_stats.header->version = MALLOC_TRACER_SHM_VERSION;
+    shm_stats.header->capacity = SHM_CALLSITES;
+    shm_stats.owner = true;
+    if (pthread_atfork(NULL, NULL, stop_in_child) != 0 ||
+        !start_tracer_thread(&shm_stats.thread, publisher_thread, NULL)) {
+        fprintf(stderr, "Error: cannot start the shared memory stats thread\n");
+        exit(1);
+    }
+}
+
+__attribute__((destructor)) static void stop_shm_stats() {
+    if (!shm_stats.owner) {
+        return;
+    }
+    shm_stats.stop.store(true, std::memory_order_release);
+    pthread_join(shm_stats.thread, NULL);
+    shm_unlink(shm_stats.name);
+}
@@ -0,0 +1,108 @@
+#include <stdio.h>
+
+#include <algorithm>
+
+#include "callsite_table.h"
+#include "malloc_tracer.h"
+#include "report.h"
+
+constexpr double MODE_SHARE = 0.1; // buckets with 10% of the allocations
+constexpr int    MAX_MODES = 3;
+
+static ExitReport size_report; // MALLOC_TRACER_SIZE_REPORT
+
+struct SizeRow {
+    malloc_tracer_callsite site;
+    std::int64_t           buckets[MALLOC_TRACER_SIZE_BUCKETS];
+    std::int64_t           allocs;
+};
+
+extern "C" int malloc_tracer_sizes(const malloc_tracer_callsite* site, int64_t* buckets) {
+    const CallsiteStats* stats = CALLSITE_TABLE.find(callsite_key(*site));
+    if (!stats) {
+        return 0;
+    }
+    const CallsiteHistograms* histograms = stats->histograms.load(std::memory_order_acquire);
+    for (std::size_t i = 0; i < MALLOC_TRACER_SIZE_BUCKETS; ++i) {
+        buckets[i] = histograms ? histograms->sizes[i].load(std::memory_order_relaxed) : 0;
+    }
+    return 1;
+}
+
+// Largest size of a bucket.
+static std::size_t bucket_ceil(unsigned bucket) {
+    return bucket + 1 < MALLOC_TRACER_SIZE_BUCKETS ? malloc_tracer_size_bucket_floor(bucket + 1) - 1
+                                                   : SIZE_MAX;
+}
+
+// Upper bound of the bucket that holds the given share of the allocations.
+static std::size_t percentile(const SizeRow& row, double share) {
+    std::int64_t seen = 0;
+    for (unsigned i = 0; i < MALLOC_TRACER_SIZE_BUCKETS; ++i) {
+        seen += row.buckets[i];
+        if (seen >= share * row.allocs) {
+            return bucket_ceil(i);
+        }
+    }
+    return SIZE_MAX;
+}
+
+static void print_row(int fd, const SizeRow& row) {
+    unsigned last = MALLOC_TRACER_SIZE_BUCKETS - 1;
+    while (last > 0 && row.buckets[last] == 0) {
+        --last;
+    }
+    dprintf(fd, "%10ld %8zu %8zu %8zu %8zu ", row.allocs, percentile(row, 0.5), percentile(row, 0.9),
+            percentile(row, 0.99), bucket_ceil(last));
+    // the most frequent buckets, a bimodal site shows two
+    unsigned modes[MALLOC_TRACER_SIZE_BUCKETS];
+    int      modeCount = 0;
+    for (unsigned i = 0; i < MALLOC_TRACER_SIZE_BUCKETS; ++i) {
+        if (row.buckets[i] > 0 && row.buckets[i] >= MODE_SHARE * row.allocs) {
+            modes[modeCount++] = i;
+        }
+    }
+    std::sort(modes, modes + modeCount,
+              [&row](unsigned a, unsigned b) { return row.buckets[a] > row.buckets[b]; });
+    modeCount = std::min(modeCount, MAX_MODES);
+    char text[128];
+    int  len = 0;
+    for (int i = 0; i < modeCount && len < static_cast<int>(sizeof(text)); ++i) {
+        len += snprintf(text + len, sizeof(text) - len, "%s%zu-%zu:%.0f%%", i ? " " : "",
+                        malloc_tracer_size_bucket_floor(modes[i]), bucket_ceil(modes[i]),
+                        100.0 * row.buckets[modes[i]] / row.allocs);
+    }
+    dprintf(fd, " %-40s", modeCount ? text : "-");
+}
+
+// Sites with allocations, most allocations first. Percentiles are bucket upper bounds, modes are the
+// buckets with at least MODE_SHARE of the allocations of the site.
+static void write_report(int fd) {
+    write_callsite_rows<SizeRow>(
+        fd,
+        [](SizeRow& row) {
+            if (!malloc_tracer_sizes(&row.site, row.buckets)) {
+                return false;
+            }
+            row.allocs = 0;
+            for (std::int64_t allocs : row.buckets) {
+                row.allocs += allocs;
+            }
+            return row.allocs > 0;
+        },
+        [](const SizeRow& a, const SizeRow& b) { return a.allocs > b.allocs; },
+        [](int fd, const SizeRow*, std::size_t count) {
+            dprintf(fd, "# request sizes of %zu sites\n", count);
+            dprintf(fd, "%10s %8s %8s %8s %8s  %-40s  %s\n", "allocs", "p50", "p90", "p99", "max", "modes",
+                    "site");
+        },
+        print_row);
+}
+
+__attribute__((constructor)) static void start_size_histograms() {
+    size_report.start("MALLOC_TRACER_SIZE_REPORT");
+}
+
+__attribute__((destructor)) static void write_size_report() {
+    size_report.finish(write_report);
+}
@@ -0,0 +1,99 @@
+#include "stack_table.h"
+
+#include "malloc_tracer.h"
+#include "tracer_memory.h"
+
+StackTable STACK_TABLE;
+
+bool StackTable::init() {
+    records = static_cast<StackRecord*>(map_tracer_memory(STACK_TABLE_MAX_RECORDS * sizeof(StackRecord)));
+    frames = static_cast<std::uintptr_t*>(map_tracer_memory(STACK_TABLE_MAX_FRAMES * sizeof(std::uintptr_t)));
+    index = static_cast<std::atomic_uint32_t*>(map_tracer_memory(STACK_TABLE_INDEX_SIZE * sizeof(*index)));
+    return records && frames && index;
+}
+
+static std::uint64_t hash_stack(const std::uintptr_t* stack, int depth) {
+    std::uint64_t hash = 0xCBF29CE484222325ull ^ depth;
+    for (int i = 0; i < depth; ++i) {
+        hash = (hash ^ stack[i]) * 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+// Ids and frames are claimed with CAS loops that stop at the limits, so record_count never passes
+// STACK_TABLE_MAX_RECORDS. A record is published by the release store of its depth, 0 until then.
+std::uint32_t StackTable::append(std::uint64_t hash, const std::uintptr_t* stack, int depth, int site_index) {
+    std::uint32_t id = record_count.load(std::memory_order_relaxed);
+    do {
+        if (id >= STACK_TABLE_MAX_RECORDS) {
+            return 0;
+        }
+    } while (!record_count.compare_exchange_weak(id, id + 1, std::memory_order_relaxed));
+    std::uint64_t offset = frame_count.load(std::memory_order_relaxed);
+    do {
+        if (offset + depth > STACK_TABLE_MAX_FRAMES) {
+            return 0; // the claimed record stays unpublished
+        }
+    } while (!frame_count.compare_exchange_weak(offset, offset + depth, std::memory_order_relaxed));
+    for (int i = 0; i < depth; ++i) {
+        frames[offset + i] = stack[i];
+    }
+    StackRecord& record = records[id];
+    record.hash = hash;
+    record.offset = static_cast<std::uint32_t>(offset);
+    record.site_index = static_cast<std::uint16_t>(site_index);
+    __atomic_store_n(&record.depth, static_cast<std::uint16_t>(depth), __ATOMIC_RELEASE);
+    return id;
+}
+
+bool StackTable::equal(std::uint32_t id, std::uint64_t hash, const std::uintptr_t* stack, int depth) const {
+    const StackRecord& record = records[id];
+    if (record.hash != hash || record.depth != depth) {
+        return false;
+    }
+    for (int i = 0; i < depth; ++i) {
+        if (frames[record.offset + i] != stack[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::uint32_t StackTable::intern(const std::uintptr_t* stack, int depth, int site_index) {
+    if (!index) {
+        return 0;
+    }
+    std::uint64_t hash = hash_stack(stack, depth);
+    std::uint32_t newId = 0;
+    for (std::size_t probe = 0; probe < STACK_TABLE_MAX_PROBES; ++probe) {
+        std::atomic_uint32_t& slot = index[(hash + probe) & (STACK_TABLE_INDEX_SIZE - 1)];
+        std::uint32_t         id = slot.load(std::memory_order_acquire);
+        if (id == 0) {
+            if (newId == 0 && (newId = append(hash, stack, depth, site_index)) == 0) {
+                break;
+            }
+            if (slot.compare_exchange_strong(id, newId, std::memory_order_acq_rel)) {
+                return newId;
+            }
+        }
+        if (equal(id, hash, stack, depth)) {
+            return id;
+        }
+    }
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    return newId; // valid but not indexed, or 0 if the table is full
+}
+
+extern "C" size_t malloc_tracer_stack(uint32_t stack_id, uintptr_t* frames, size_t max_count) {
+    if (stack_id == 0 || stack_id >= STACK_TABLE_MAX_RECORDS || !STACK_TABLE.records ||
+        stack_id >= STACK_TABLE.record_count.load(std::memory_order_acquire)) {
+        return 0;
+    }
+    const StackRecord& record = STACK_TABLE.records[stack_id];
+    std::uint16_t      depth = STACK_TABLE.depth(stack_id);
+    for (size_t i = 0; i < depth && i < max_count; ++i) {
+        frames[i] = STACK_TABLE.frames[record.offset + i];
+    }
+    return depth;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+constexpr std::size_t STACK_TABLE_MAX_RECORDS = 1 << 20;
+constexpr std::size_t STACK_TABLE_MAX_FRAMES = 1 << 24;
+constexpr std::size_t STACK_TABLE_INDEX_SIZE = 1 << 21; // must be a power of two
+constexpr std::size_t STACK_TABLE_MAX_PROBES = 256;
+
+struct StackRecord {
+    std::uint64_t hash;
+    std::uint32_t offset;     // first frame in StackTable::frames
+    std::uint16_t depth;      // frames[offset] is the innermost frame, 0 until the record is published
+    std::uint16_t site_index; // frame the allocation is attributed to, see caller_site()
+};
+
+// Deduplicating table of stack traces in tracer-owned memory. A stack is appended once to `records` and
+// `frames` and identified by its 32-bit index in `records`. Id 0 means "no stack" (the table is full).
+// Insertion is lock-free: the record is written first, its depth last, and then it is published by a CAS in
+// the open-addressing `index`. Two threads racing on the same new stack may both append it, the loser's copy
+// is never indexed. Nothing is ever removed, so a record stays valid for the lifetime of the process and can
+// be read from a core.
+struct StackTable {
+    StackRecord*          records = nullptr;
+    std::uintptr_t*       frames = nullptr;
+    std::atomic_uint32_t* index = nullptr;
+    std::atomic_uint32_t  record_count{1};
+    std::atomic_uint64_t  frame_count{0};
+    std::atomic_uint64_t  dropped{0}; // stacks that got id 0 or were not indexed
+
+    bool init();
+
+    std::uint32_t intern(const std::uintptr_t* stack, int depth, int site_index);
+
+    // Frames of a published record, 0 for one still being written.
+    std::uint16_t depth(std::uint32_t id) const {
+        return __atomic_load_n(&records[id].depth, __ATOMIC_ACQUIRE);
+    }
+
+    // 0 for a record still being written.
+    std::uintptr_t site(std::uint32_t id) const {
+        if (depth(id) == 0) {
+            return 0;
+        }
+        const StackRecord& record = records[id];
+        return frames[record.offset + record.site_index];
+    }
+
+private:
+    std::uint32_t append(std::uint64_t hash, const std::uintptr_t* stack, int depth, int site_index);
+    bool          equal(std::uint32_t id, std::uint64_t hash, const std::uintptr_t* stack, int depth) const;
+};
+
+extern StackTable STACK_TABLE;
@@ -0,0 +1,238 @@
+#include "stack_trace.h"
+
+#include <link.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sharded_counter.h"
+#ifdef TURN_ON_STACK_IDS
+#    include "stack_table.h"
+#endif
+
+constexpr std::uintptr_t MAX_FRAME_SIZE = 1 << 20;
+constexpr std::uintptr_t MAX_SCANNED_WORDS = 1024;
+constexpr int            MAX_TRACER_FRAMES = 8;
+constexpr int            MAX_CODE_RANGES = 128;
+
+int STACK_TRACE_DEPTH = 8;
+
+// Stack of the current thread from pthread_getattr_np(), both 1 if it is unknown.
+static thread_local std::uintptr_t STACK_BOTTOM TRACER_TLS = 0;
+static thread_local std::uintptr_t STACK_TOP TRACER_TLS = 0;
+static thread_local bool           READING_STACK_RANGE TRACER_TLS = false;
+
+// Executable segments of the objects loaded at startup. `skipped` marks the runtime libraries.
+static struct CodeRanges {
+    struct Range {
+        std::uintptr_t start;
+        std::uintptr_t end;
+        bool           skipped;
+    } ranges[MAX_CODE_RANGES]{};
+    int count = 0;
+} code_ranges;
+
+void init_stack_traces() {
+    if (const char* depth = getenv("MALLOC_TRACER_STACK_DEPTH")) {
+        int value = atoi(depth);
+        STACK_TRACE_DEPTH = value < 1 ? 1 : (value > STACK_TRACE_MAX_DEPTH ? STACK_TRACE_MAX_DEPTH : value);
+    }
+#ifdef TURN_ON_STACK_IDS
+    if (!STACK_TABLE.init()) {
+        fprintf(stderr, "Error: no memory for the stack table\n");
+        exit(1);
+    }
+#endif
+}
+
+// Upper bound of the stack of the current thread, 0 if sp is not on it: a fiber, a coroutine or a signal
+// stack, whose extent is unknown. pthread_getattr_np() may allocate, allocations meanwhile get no stack.
+static std::uintptr_t stack_top(std::uintptr_t sp) {
+    if (STACK_TOP == 0) {
+        if (READING_STACK_RANGE) {
+            return 0;
+        }
+        READING_STACK_RANGE = true;
+        STACK_BOTTOM = STACK_TOP = 1;
+        pthread_attr_t attr;
+        if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+            void*  bottom;
+            size_t size;
+            if (pthread_attr_getstack(&attr, &bottom, &size) == 0) {
+                STACK_BOTTOM = reinterpret_cast<std::uintptr_t>(bottom);
+                STACK_TOP = STACK_BOTTOM + size;
+            }
+            pthread_attr_destroy(&attr);
+        }
+        READING_STACK_RANGE = false;
+    }
+    return sp >= STACK_BOTTOM && sp < STACK_TOP ? STACK_TOP : 0;
+}
+
+static const CodeRanges::Range* find_code(std::uintptr_t addr) {
+    for (int i = 0; i < code_ranges.count; ++i) {
+        if (addr >= code_ranges.ranges[i].start && addr < code_ranges.ranges[i].end) {
+            return &code_ranges.ranges[i];
+        }
+    }
+    return nullptr;
+}
+
+static bool is_skipped(std::uintptr_t addr) {
+    const CodeRanges::Range* range = find_code(addr);
+    return range && range->skipped;
+}
+
+// True if addr follows a call instruction, i.e. it can be a return address.
+static bool follows_call(const CodeRanges::Range* range, std::uintptr_t addr) {
+    if (addr - range->start < 8) {
+        return false;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    const auto* code = reinterpret_cast<const unsigned char*>(addr);
+    if (code[-5] == 0xE8) { // call rel32
+        return true;
+    }
+    for (int len = 2; len <= 7; ++len) { // call r/m: FF /2 with an optional SIB byte and displacement
+        if (code[-len] == 0xFF && (code[1 - len] & 0x38) == 0x10) {
+            return true;
+        }
+    }
+    return false;
+#elif defined(__aarch64__)
+    std::uint32_t insn = *reinterpret_cast<const std::uint32_t*>(addr - 4);
+    return (insn & 0xFC000000) == 0x94000000 || (insn & 0xFFFFFC1F) == 0xD63F0000; // bl, blr
+#else
+    return true;
+#endif
+}
+
+static bool is_frame_pointer(std::uintptr_t next, std::uintptr_t fp, std::uintptr_t top) {
+    return next > fp && next - fp <= MAX_FRAME_SIZE && next + 2 * sizeof(std::uintptr_t) <= top &&
+           (next & (sizeof(std::uintptr_t) - 1)) == 0;
+}
+
+// The saved frame pointer is not checked: it is junk if the caller is a runtime function.
+static bool is_frame_record(std::uintptr_t record) {
+    std::uintptr_t           ret = reinterpret_cast<std::uintptr_t*>(record)[1];
+    const CodeRanges::Range* range = find_code(ret);
+    return range && follows_call(range, ret);
+}
+
+// The runtime libraries are built without frame pointers, so the frame pointer saved while their code runs is
+// junk. Scans the stack from the frame record `from` up for the first pointer to a valid frame record: the
+// frame pointer of the nearest caller with frame pointers, kept in rbp or spilled by a runtime function
+// prologue. The return address into that caller is the highest return address into other code below its
+// record: lower slots may hold stale values. Returns the frame record or 0.
+static std::uintptr_t scan_stack(std::uintptr_t from, std::uintptr_t top, std::uintptr_t* ret) {
+    std::uintptr_t end = from + MAX_SCANNED_WORDS * sizeof(std::uintptr_t);
+    std::uintptr_t record = 0;
+    for (std::uintptr_t pos = from; pos + sizeof(std::uintptr_t) <= top && pos < end && record == 0;
+         pos += sizeof(std::uintptr_t)) {
+        std::uintptr_t word = *reinterpret_cast<std::uintptr_t*>(pos);
+        if (is_frame_pointer(word, pos, top) && is_frame_record(word)) {
+            record = word;
+        }
+    }
+    *ret = 0;
+    for (std::uintptr_t pos = record; pos > from && *ret == 0;) {
+        pos -= sizeof(std::uintptr_t);
+        std::uintptr_t           word = *reinterpret_cast<std::uintptr_t*>(pos);
+        const CodeRanges::Range* range = find_code(word);
+        if (range && !range->skipped && follows_call(range, word)) {
+            *ret = word;
+        }
+    }
+    return record;
+}
+
+__attribute__((noinline)) int capture_stack(std::uintptr_t ret_addr, std::uintptr_t* frames, int max_depth) {
+    auto           fp = reinterpret_cast<std::uintptr_t>(__builtin_frame_address(0));
+    std::uintptr_t top = stack_top(fp); // the walk and the scans read [fp, top) only
+    int            depth = 0;
+    int            tracerFrames = 0;
+    while (depth < max_depth && fp + 2 * sizeof(std::uintptr_t) <= top) {
+        std::uintptr_t next = reinterpret_cast<std::uintptr_t*>(fp)[0];
+        std::uintptr_t ret = reinterpret_cast<std::uintptr_t*>(fp)[1];
+        if (depth > 0 || ret == ret_addr) {
+            frames[depth++] = ret;
+        } else if (++tracerFrames > MAX_TRACER_FRAMES) {
+            break;
+        }
+        if (depth > 0 && is_skipped(ret)) {
+            std::uintptr_t scanned = 0;
+            next = scan_stack(fp, top, &scanned);
+            if (scanned != 0 && depth < max_depth) {
+                frames[depth++] = scanned;
+            }
+            if (next == 0) {
+                break;
+            }
+        } else if (ret == 0 || !is_frame_pointer(next, fp, top)) {
+            break;
+        }
+        fp = next;
+    }
+    if (depth == 0) {
+        frames[depth++] = ret_addr;
+    }
+    return depth;
+}
+
+// Index of the first frame outside of the runtime libraries, 0 if there is none.
+static int attributed_frame(const std::uintptr_t* frames, int depth) {
+    for (int i = 0; i < depth; ++i) {
+        if (!is_skipped(frames[i])) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+std::uintptr_t caller_site(std::uintptr_t ret_addr) {
+    if (STACK_TRACE_DEPTH <= 1 || !is_skipped(ret_addr)) {
+        return ret_addr;
+    }
+    std::uintptr_t frames[STACK_TRACE_MAX_DEPTH];
+    int            depth = capture_stack(ret_addr, frames, STACK_TRACE_DEPTH);
+    return frames[attributed_frame(frames, depth)];
+}
+
+#ifdef TURN_ON_STACK_IDS
+std::uintptr_t allocation_site(std::uintptr_t ret_addr) {
+    std::uintptr_t frames[STACK_TRACE_MAX_DEPTH];
+    int            depth = capture_stack(ret_addr, frames, STACK_TRACE_DEPTH);
+    return STACK_TABLE.intern(frames, depth, attributed_frame(frames, depth));
+}
+#else
+std::uintptr_t allocation_site(std::uintptr_t ret_addr) {
+    return caller_site(ret_addr);
+}
+#endif
+
+static int add_code_ranges(struct dl_phdr_info* info, size_t, void* data) {
+    const char* names = static_cast<const char*>(data);
+    const char* name = info->dlpi_name ? info->dlpi_name : "";
+    bool        skipped = false;
+    for (const char* pattern = names; *name && *pattern && !skipped;) {
+        const char* end = strchrnul(pattern, ':');
+        skipped = end != pattern && memmem(name, strlen(name), pattern, end - pattern) != NULL;
+        pattern = *end ? end + 1 : end;
+    }
+    for (int i = 0; i < info->dlpi_phnum && code_ranges.count < MAX_CODE_RANGES; ++i) {
+        const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+        if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_X)) {
+            std::uintptr_t start = info->dlpi_addr + phdr.p_vaddr;
+            code_ranges.ranges[code_ranges.count++] = {start, start + phdr.p_memsz, skipped};
+        }
+    }
+    return 0;
+}
+
+// Libraries are mapped by now, unlike at the first malloc() call which may happen inside the dynamic loader.
+__attribute__((constructor)) static void load_code_ranges() {
+    const char* names = getenv("MALLOC_TRACER_SKIP_LIBS");
+    dl_iterate_phdr(add_code_ranges, const_cast<char*>(names ? names : "libstdc++:libc.so"));
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+
+constexpr int STACK_TRACE_MAX_DEPTH = 32;
+
+// Number of frames captured per traced allocation, MALLOC_TRACER_STACK_DEPTH. Default 8.
+extern int STACK_TRACE_DEPTH;
+
+// Reads MALLOC_TRACER_STACK_DEPTH and maps the stack table with TURN_ON_STACK_IDS. Called from
+// __lib_hook_init().
+void init_stack_traces();
+
+// Walks the frame-pointer chain of the current thread. Tracer frames are skipped up to the frame returning to
+// ret_addr, so frames[0] is always ret_addr. Frames of the runtime libraries, built without frame pointers,
+// are stepped over by a bounded stack scan. The walk stops at a frame pointer that does not go up the stack,
+// jumps too far or leaves the thread stack, so broken chains end the trace instead of crashing. Returns the
+// number of captured frames, at least 1.
+int capture_stack(std::uintptr_t ret_addr, std::uintptr_t* frames, int max_depth);
+
+// Return address attributed to an allocation: the first captured frame outside of the runtime libraries
+// (MALLOC_TRACER_SKIP_LIBS, default "libstdc++:libc.so"), so std::vector or std::string allocations are
+// attributed to the application code that uses them.
+std::uintptr_t caller_site(std::uintptr_t ret_addr);
+
+// Site stored in the footer of a traced allocation: caller_site(), or with TURN_ON_STACK_IDS the STACK_TABLE
+// id of the whole captured stack (0 if the table is full).
+std::uintptr_t allocation_site(std::uintptr_t ret_addr);
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// The mmap() family as raw system calls: the tracer's own mappings must not reach the hooks of
+// TURN_ON_MMAP_STATS, which would attribute them to the tracer and could recurse into it.
+inline void* tracer_mmap(void* addr, std::size_t length, int prot, int flags, int fd, off_t offset) {
+    return reinterpret_cast<void*>(syscall(SYS_mmap, addr, length, prot, flags, fd, offset));
+}
+
+inline int tracer_munmap(void* addr, std::size_t length) {
+    return static_cast<int>(syscall(SYS_munmap, addr, length));
+}
+
+inline void* tracer_mremap(void* oldAddress, std::size_t oldLength, std::size_t newLength, int flags,
+                           void* newAddress) {
+    return reinterpret_cast<void*>(syscall(SYS_mremap, oldAddress, oldLength, newLength, flags, newAddress));
+}
+
+// Memory for the tracer's own tables. It never comes from the hooked allocator, pages are committed
+// lazily by the kernel on first touch and stay in core dumps.
+inline void* map_tracer_memory(std::size_t size) {
+    void* ptr =
+        tracer_mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return ptr == MAP_FAILED ? nullptr : ptr;
+}
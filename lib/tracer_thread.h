@@ -0,0 +1,21 @@
+#pragma once
+
+#include <pthread.h>
+#include <signal.h>
+
+#include "sharded_counter.h"
+
+// Set by the body of every background thread of the tracer: allocations made by those threads are not traced.
+inline thread_local bool TRACER_THREAD TRACER_TLS = false;
+
+// Starts a background thread of the tracer. All signals are blocked in it, so signal handlers of the
+// application never run on a tracer thread. Returns false on failure.
+inline bool start_tracer_thread(pthread_t* thread, void* (*body)(void*), void* arg) {
+    sigset_t all;
+    sigset_t old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int rc = pthread_create(thread, NULL, body, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return rc == 0;
+}
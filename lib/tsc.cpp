@@ -0,0 +1,19 @@
+#include "tsc.h"
+
+#include "malloc_tracer.h"
+
+// tsc/ns pair taken at load time, the conversion rate is measured against it.
+static struct TscStart {
+    std::uint64_t tsc = 0;
+    std::uint64_t ns = 0;
+} tsc_start;
+
+__attribute__((constructor)) static void start_tsc_clock() {
+    tsc_start.tsc = read_tsc();
+    tsc_start.ns = monotonic_ns();
+}
+
+extern "C" double malloc_tracer_ns_per_tick(void) {
+    std::uint64_t ticks = read_tsc() - tsc_start.tsc;
+    return ticks == 0 ? 1.0 : static_cast<double>(monotonic_ns() - tsc_start.ns) / ticks;
+}
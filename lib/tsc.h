@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#    include <x86intrin.h>
+#endif
+
+// Cheap monotonic timestamp: the time stamp counter, the virtual counter on aarch64, CLOCK_MONOTONIC
+// nanoseconds elsewhere. Ticks are converted to nanoseconds with tsc/ns pairs taken apart in time.
+inline std::uint64_t read_tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    std::uint64_t value;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+#endif
+}
+
+inline std::uint64_t monotonic_ns() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
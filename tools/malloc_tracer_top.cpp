@@ -0,0 +1,180 @@
+// Live view of the per-callsite statistics a process traced by libmalloc_tracer.so (TURN_ON_SHM_STATS=ON,
+// MALLOC_TRACER_SHM=<ms>) publishes in /dev/shm/malloc_tracer.<pid>. The target is never stopped.
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "malloc_tracer.h"
+
+struct Mapping {
+    std::uintptr_t start;
+    std::uintptr_t end;
+    std::uintptr_t offset;
+    std::string    path;
+};
+
+struct Snapshot {
+    malloc_tracer_shm_header            header;
+    std::vector<malloc_tracer_callsite> callsites;
+};
+
+static std::vector<Mapping> read_mappings(int pid) {
+    std::vector<Mapping> mappings;
+    std::ifstream        maps("/proc/" + std::to_string(pid) + "/maps");
+    std::string          line;
+    while (std::getline(maps, line)) {
+        std::istringstream fields(line);
+        std::string        range, perms, offset, dev, inode, path;
+        fields >> range >> perms >> offset >> dev >> inode >> path;
+        if (perms.find('x') == std::string::npos || path.empty()) {
+            continue;
+        }
+        Mapping mapping;
+        mapping.start = std::stoull(range.substr(0, range.find('-')), nullptr, 16);
+        mapping.end = std::stoull(range.substr(range.find('-') + 1), nullptr, 16);
+        mapping.offset = std::stoull(offset, nullptr, 16);
+        mapping.path = path.substr(path.rfind('/') + 1);
+        mappings.push_back(mapping);
+    }
+    return mappings;
+}
+
+// "lib+0xoffset" for addr2line, or the bare address.
+static std::string describe(std::uintptr_t addr, const std::vector<Mapping>& mappings) {
+    char buf[512];
+    if (addr == 0) {
+        return "unknown (table overflow)";
+    }
+    for (const Mapping& mapping : mappings) {
+        if (addr >= mapping.start && addr < mapping.end) {
+            snprintf(buf, sizeof(buf), "%s+0x%" PRIxPTR, mapping.path.c_str(),
+                     addr - mapping.start + mapping.offset);
+            return buf;
+        }
+    }
+    snprintf(buf, sizeof(buf), "0x%" PRIxPTR, addr);
+    return buf;
+}
+
+static std::string human_size(std::int64_t bytes) {
+    const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    double      value = static_cast<double>(bytes);
+    int         unit = 0;
+    while ((value >= 1024 || value <= -1024) && unit < 4) {
+        value /= 1024;
+        ++unit;
+    }
+    char buf[32];
+    snprintf(buf, sizeof(buf), unit ? "%.1f %s" : "%.0f %s", value, units[unit]);
+    return buf;
+}
+
+// Seqlock read, see malloc_tracer_shm_header.
+static void read_snapshot(const malloc_tracer_shm_header* shared, Snapshot* snapshot) {
+    const auto* callsites = reinterpret_cast<const malloc_tracer_callsite*>(shared + 1);
+    for (;;) {
+        std::uint64_t seq = __atomic_load_n(&shared->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        snapshot->header = *shared;
+        std::size_t count = std::min<std::uint64_t>(snapshot->header.callsite_count, shared->capacity);
+        snapshot->callsites.assign(callsites, callsites + count);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shared->seq, __ATOMIC_RELAXED) == seq) {
+            return;
+        }
+    }
+}
+
+static void print_snapshot(int pid, Snapshot& snapshot, std::size_t top,
+                           const std::vector<Mapping>& mappings) {
+    const malloc_tracer_shm_header& header = snapshot.header;
+    std::int64_t                    liveBytes = 0;
+    std::int64_t                    liveCount = 0;
+    for (const auto& callsite : snapshot.callsites) {
+        liveBytes += callsite.live_bytes;
+        liveCount += callsite.live_count;
+    }
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    double age = (now.tv_sec * 1000000000.0 + now.tv_nsec - header.update_ns) / 1e9;
+    printf("malloc_tracer_top - pid %d, updated %.1fs ago\n", pid, age);
+    printf("Live: %s in %" PRId64 " blocks; counters: %" PRId64 " allocs, %s; sites: %" PRIu64
+           "; unknown frees: %" PRIu64 "\n\n",
+           human_size(liveBytes).c_str(), liveCount, header.total_allocs,
+           human_size(header.total_allocated_bytes).c_str(), header.callsite_count, header.unknown_frees);
+    std::sort(snapshot.callsites.begin(), snapshot.callsites.end(),
+              [](const auto& a, const auto& b) { return a.live_bytes > b.live_bytes; });
+    printf("%12s %12s %12s %14s  %s\n", "LIVE", "LIVE COUNT", "TOTAL", "TOTAL COUNT", "SITE");
+    for (std::size_t i = 0; i < snapshot.callsites.size() && i < top; ++i) {
+        const malloc_tracer_callsite& callsite = snapshot.callsites[i];
+        printf("%12s %12" PRId64 " %12s %14" PRId64 "  %s\n", human_size(callsite.live_bytes).c_str(),
+               callsite.live_count, human_size(callsite.total_bytes).c_str(), callsite.total_count,
+               describe(callsite.ret_addr, mappings).c_str());
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <pid> [top sites, default 20] [--once]\n", argv[0]);
+        return 1;
+    }
+    int         pid = atoi(argv[1]);
+    std::size_t top = argc > 2 && argv[2][0] != '-' ? strtoul(argv[2], NULL, 10) : 20;
+    bool        once = strcmp(argv[argc - 1], "--once") == 0;
+
+    std::string name = "/malloc_tracer." + std::to_string(pid);
+    int         fd = shm_open(name.c_str(), O_RDONLY, 0);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 ||
+        static_cast<std::size_t>(st.st_size) < sizeof(malloc_tracer_shm_header)) {
+        fprintf(stderr, "Error: cannot open /dev/shm%s: %s\n", name.c_str(), strerror(errno));
+        return 1;
+    }
+    void* memory = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        fprintf(stderr, "Error: cannot map /dev/shm%s: %s\n", name.c_str(), strerror(errno));
+        return 1;
+    }
+    const auto* shared = static_cast<const malloc_tracer_shm_header*>(memory);
+    if (memcmp(shared->magic, MALLOC_TRACER_SHM_MAGIC, sizeof(MALLOC_TRACER_SHM_MAGIC)) != 0 ||
+        shared->version != MALLOC_TRACER_SHM_VERSION ||
+        sizeof(*shared) + shared->capacity * sizeof(malloc_tracer_callsite) >
+            static_cast<std::size_t>(st.st_size)) {
+        fprintf(stderr, "Error: /dev/shm%s is not a malloc_tracer stats segment of this version\n",
+                name.c_str());
+        return 1;
+    }
+
+    std::vector<Mapping> mappings = read_mappings(pid);
+    Snapshot             snapshot;
+    do {
+        read_snapshot(shared, &snapshot);
+        if (!once) {
+            printf("\033[H\033[2J");
+        }
+        print_snapshot(pid, snapshot, top, mappings);
+        if (!once) {
+            sleep(1);
+        }
+    } while (!once && kill(pid, 0) == 0);
+    return 0;
+}